@@ -15,11 +15,11 @@
 
 
 # Specification in the form of a command-line invocation:
-#   gnulib-tool --import --dir=. --lib=libgnu --source-base=gnulib/lib --m4-base=gnulib/m4 --doc-base=doc --aux-dir=admin --no-libtool --macro-prefix=gl canonicalize-lgpl config-h d-type error fnmatch-gnu fwriteerror getopt gettext-h mbsstr mempcpy obstack progname safe-read stat-time strchrnul timespec verify xalloc
+#   gnulib-tool --import --dir=. --lib=libgnu --source-base=gnulib/lib --m4-base=gnulib/m4 --doc-base=doc --aux-dir=admin --no-libtool --macro-prefix=gl canonicalize-lgpl config-h d-type error fnmatch-gnu full-write fwriteerror getopt gettext-h mbsstr mempcpy obstack progname safe-read stat-time strchrnul timespec verify xalloc
 
 # Specification in the form of a few gnulib-tool.m4 macro invocations:
 gl_LOCAL_DIR([])
-gl_MODULES([canonicalize-lgpl config-h d-type error fnmatch-gnu fwriteerror getopt gettext-h mbsstr mempcpy obstack progname safe-read stat-time strchrnul timespec verify xalloc])
+gl_MODULES([canonicalize-lgpl config-h d-type error fnmatch-gnu full-write fwriteerror getopt gettext-h mbsstr mempcpy obstack progname safe-read stat-time strchrnul timespec verify xalloc])
 gl_AVOID([])
 gl_SOURCE_BASE([gnulib/lib])
 gl_M4_BASE([gnulib/m4])
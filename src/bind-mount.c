@@ -26,12 +26,23 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
+#if HAVE_DECL_SYS_LISTMOUNT && HAVE_DECL_SYS_STATMOUNT \
+  && defined (HAVE_STRUCT_STATMOUNT)
+#include <errno.h>
+#include <stdint.h>
+#include <linux/mount.h>
+#include <sys/syscall.h>
+#define USE_LISTMOUNT 1
+#endif
 
 #include "obstack.h"
+#include "xalloc.h"
 
 #include "bind-mount.h"
 #include "conf.h"
 #include "lib.h"
+#include "probes.h"
 
  /* mountinfo handling */
 
@@ -44,38 +55,65 @@ struct mount
   char *mount_point;
   char *fs_type;
   char *source;
+  /* The following are computed by rebuild_bind_mount_paths () */
+  /* The same entry in the previous mount table, if it is unchanged, or NULL */
+  const struct mount *previous;
+  bool is_bind_mount;
+};
+
+/* A parsed copy of mountinfo */
+struct mount_table
+{
+  /* Pointers to struct mount, sorted by ID after rebuild_bind_mount_paths () */
+  void **entries;
+  size_t num_entries;
+  /* Number of entries with is_bind_mount set */
+  size_t num_bind_mounts;
+
+  /* Obstack of struct mount entries. */
+  struct obstack data_obstack;
+  void *data_mark;
+  /* Obstack of strings referenced in mount entries. */
+  struct obstack string_obstack;
+  void *string_mark;
+  /* Obstack of 'void *' (struct mount *) pointers, for entries */
+  struct obstack list_obstack;
 };
 
 /* Path to mountinfo */
 static const char *mountinfo_path;
 
-/* Pointers to struct mount. */
-static void **mount_entries;
-static size_t num_mount_entries;
-
-/* Obstack of struct mount entries. */
-static struct obstack mount_data_obstack;
-static void *mount_data_mark;
-/* Obstack of strings referenced in mount entries. */
-static struct obstack mount_string_obstack;
-static void *mount_string_mark;
-/* Obstack of 'void *' (struct mount *) pointers, for mount_entries */
-static struct obstack mount_list_obstack;
+/* The two most recent copies of mountinfo_path.  The previous one is kept so
+   that a rebuild only needs to look at mounts that have changed. */
+static struct mount_table mount_tables[2];
+static struct mount_table *current_mounts, *previous_mounts;
 
 /* Obstack used for a mountinfo line buffer */
 static struct obstack mountinfo_line_obstack;
 
+/* Initialize TABLE */
+static void
+mount_table_init (struct mount_table *table)
+{
+  obstack_init (&table->data_obstack);
+  table->data_mark = obstack_alloc (&table->data_obstack, 0);
+  obstack_init (&table->string_obstack);
+  obstack_alignment_mask (&table->string_obstack) = 0;
+  table->string_mark = obstack_alloc (&table->string_obstack, 0);
+  obstack_init (&table->list_obstack);
+  table->entries = obstack_alloc (&table->list_obstack, 0);
+  table->num_entries = 0;
+  table->num_bind_mounts = 0;
+}
+
 /* Initialize state for read_mount_entries () */
 static void
 init_mount_entries (void)
 {
-  obstack_init (&mount_data_obstack);
-  mount_data_mark = obstack_alloc (&mount_data_obstack, 0);
-  obstack_init (&mount_string_obstack);
-  obstack_alignment_mask (&mount_string_obstack) = 0;
-  mount_string_mark = obstack_alloc (&mount_string_obstack, 0);
-  obstack_init (&mount_list_obstack);
-  mount_entries = obstack_alloc (&mount_list_obstack, 0);
+  mount_table_init (&mount_tables[0]);
+  mount_table_init (&mount_tables[1]);
+  current_mounts = &mount_tables[0];
+  previous_mounts = &mount_tables[1];
   obstack_init (&mountinfo_line_obstack);
   obstack_alignment_mask (&mountinfo_line_obstack) = 0;
 }
@@ -117,10 +155,10 @@ read_mount_line (FILE *f)
 }
 
 /* Parse a space-delimited entry in STRING, decode octal escapes, write it to
-   DEST (allocated from mount_string_obstack) if it is not NULL.
+   DEST (allocated from TABLE->string_obstack) if it is not NULL.
    Return 0 if OK, -1 on error. */
 static int
-parse_mount_string (char **dest, char **string)
+parse_mount_string (struct mount_table *table, char **dest, char **string)
 {
   char *src, *ret;
 
@@ -150,7 +188,7 @@ parse_mount_string (char **dest, char **string)
 		| (src[3] - '0');
 	      if (v <= UCHAR_MAX)
 		{
-		  obstack_1grow (&mount_string_obstack, (char)v);
+		  obstack_1grow (&table->string_obstack, (char)v);
 		  src += 4;
 		  break;
 		}
@@ -158,30 +196,30 @@ parse_mount_string (char **dest, char **string)
 	  /* Else fall through */
 
 	default:
-	  obstack_1grow (&mount_string_obstack, c);
+	  obstack_1grow (&table->string_obstack, c);
 	  src++;
 	}
     }
  done:
   *string = src;
-  obstack_1grow (&mount_string_obstack, 0);
-  ret = obstack_finish (&mount_string_obstack);
+  obstack_1grow (&table->string_obstack, 0);
+  ret = obstack_finish (&table->string_obstack);
   if (dest != NULL)
     *dest = ret;
   else
-    obstack_free (&mount_string_obstack, ret);
+    obstack_free (&table->string_obstack, ret);
   return 0;
 
  error:
-  ret = obstack_finish (&mount_string_obstack);
-  obstack_free (&mount_string_obstack, ret);
+  ret = obstack_finish (&table->string_obstack);
+  obstack_free (&table->string_obstack, ret);
   return -1;
 }
 
-/* Read a single entry from F.
+/* Read a single entry from F into TABLE.
    Return the entry, or NULL on error. */
 static struct mount *
-read_mount_entry (FILE *f)
+read_mount_entry (struct mount_table *table, FILE *f)
 {
   struct mount *me;
   char *line;
@@ -191,75 +229,218 @@ read_mount_entry (FILE *f)
   line = read_mount_line (f);
   if (line == NULL)
     return NULL;
-  me = obstack_alloc (&mount_data_obstack, sizeof (*me));
+  me = obstack_alloc (&table->data_obstack, sizeof (*me));
   if (sscanf (line, "%d %d %u:%u%zn", &me->id, &me->parent_id, &me->dev_major,
 	      &me->dev_minor, &offset) != 4)
     goto error;
   line += offset;
-  if (parse_mount_string (&me->root, &line) != 0
-      || parse_mount_string (&me->mount_point, &line) != 0
-      || parse_mount_string (NULL, &line) != 0)
+  if (parse_mount_string (table, &me->root, &line) != 0
+      || parse_mount_string (table, &me->mount_point, &line) != 0
+      || parse_mount_string (table, NULL, &line) != 0)
     goto error;
   do
     {
       char *option;
 
-      if (parse_mount_string (&option, &line) != 0)
+      if (parse_mount_string (table, &option, &line) != 0)
 	goto error;
       separator_found = strcmp (option, "-") == 0;
-      obstack_free (&mount_string_obstack, option);
+      obstack_free (&table->string_obstack, option);
     }
   while (!separator_found);
-  if (parse_mount_string (&me->fs_type, &line) != 0
-      || parse_mount_string (&me->source, &line) != 0
-      || parse_mount_string (NULL, &line) != 0)
+  if (parse_mount_string (table, &me->fs_type, &line) != 0
+      || parse_mount_string (table, &me->source, &line) != 0
+      || parse_mount_string (table, NULL, &line) != 0)
     goto error;
+  me->previous = NULL;
+  me->is_bind_mount = false;
   return me;
 
  error:
   /* "line" is the only thing we really need to free, the strings in "me" will
      be freed when read_mount_entries starts again. */
-  obstack_free (&mount_data_obstack, me);
+  obstack_free (&table->data_obstack, me);
   obstack_free (&mountinfo_line_obstack, line);
   return NULL;
 }
 
-/* Read mount information from mountinfo_path, update mount_entries and
-   num_mount_entries.
+/* Discard contents of TABLE, prepare it for adding new entries */
+static void
+mount_table_clear (struct mount_table *table)
+{
+  obstack_free (&table->data_obstack, table->data_mark);
+  table->data_mark = obstack_alloc (&table->data_obstack, 0);
+  obstack_free (&table->string_obstack, table->string_mark);
+  table->string_mark = obstack_alloc (&table->string_obstack, 0);
+  obstack_free (&table->list_obstack, table->entries);
+}
+
+/* Add ME to TABLE */
+static void
+mount_table_add (struct mount_table *table, struct mount *me)
+{
+  if (conf_debug_pruning != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, " `%s' (%d on %d) is `%s' of `%s' (%u:%u), type `%s'\n",
+	     me->mount_point, me->id, me->parent_id, me->root, me->source,
+	     me->dev_major, me->dev_minor, me->fs_type);
+  obstack_ptr_grow (&table->list_obstack, me);
+}
+
+/* Finish adding entries to TABLE */
+static void
+mount_table_finish (struct mount_table *table)
+{
+  table->num_entries = OBSTACK_OBJECT_SIZE (&table->list_obstack)
+    / sizeof (*table->entries);
+  table->entries = obstack_finish (&table->list_obstack);
+  table->num_bind_mounts = 0;
+}
+
+#ifdef USE_LISTMOUNT
+/* Number of mount IDs to ask for in one listmount () call */
+enum { LISTMOUNT_BATCH = 512 };
+
+/* Buffer for statmount () results */
+static struct statmount *statmount_buf;
+static size_t statmount_buf_size; /* = 0; */
+
+/* Store information about mount with unique MNT_ID to statmount_buf.
    Return 0 if OK, -1 on error. */
 static int
-read_mount_entries (void)
+get_statmount (uint64_t mnt_id)
+{
+  struct mnt_id_req req;
+  uint64_t mask;
+
+  memset (&req, 0, sizeof (req));
+  req.size = MNT_ID_REQ_SIZE_VER0;
+  req.mnt_id = mnt_id;
+  /* Only ask for what rebuild_bind_mount_paths () needs. */
+  mask = (STATMOUNT_SB_BASIC | STATMOUNT_MNT_BASIC | STATMOUNT_MNT_ROOT
+	  | STATMOUNT_MNT_POINT | STATMOUNT_FS_TYPE);
+  req.param = mask;
+  if (statmount_buf == NULL)
+    {
+      statmount_buf_size = 4096;
+      statmount_buf = xmalloc (statmount_buf_size);
+    }
+  while (syscall (SYS_statmount, &req, statmount_buf, statmount_buf_size, 0)
+	 != 0)
+    {
+      if (errno != EOVERFLOW)
+	return -1;
+      statmount_buf = x2realloc (statmount_buf, &statmount_buf_size);
+    }
+  if ((statmount_buf->mask & mask) != mask)
+    return -1;
+  return 0;
+}
+
+/* Read mount information using listmount () and statmount (), replace
+   contents of TABLE.  This avoids formatting and parsing the text of
+   MOUNTINFO_PATH, which is expensive with many mounts.
+   Return 0 if OK, -1 if the system calls are not available or fail. */
+static int
+read_mount_entries_listmount (struct mount_table *table)
+{
+  static bool listmount_failed; /* = false; */
+
+  uint64_t ids[LISTMOUNT_BATCH];
+  struct mnt_id_req req;
+  long res;
+
+  if (listmount_failed != false)
+    return -1;
+  memset (&req, 0, sizeof (req));
+  req.size = MNT_ID_REQ_SIZE_VER0;
+  req.mnt_id = LSMT_ROOT;
+  req.param = 0;
+  res = syscall (SYS_listmount, &req, ids, ARRAY_SIZE (ids), 0);
+  if (res < 0)
+    {
+      listmount_failed = true;
+      return -1;
+    }
+  mount_table_clear (table);
+  while (res > 0)
+    {
+      long i;
+
+      for (i = 0; i < res; i++)
+	{
+	  struct statmount *sm;
+	  struct mount *me;
+
+	  if (get_statmount (ids[i]) != 0)
+	    continue; /* Most likely unmounted in the meantime */
+	  sm = statmount_buf;
+	  me = obstack_alloc (&table->data_obstack, sizeof (*me));
+	  me->id = sm->mnt_id_old;
+	  me->parent_id = sm->mnt_parent_id_old;
+	  me->dev_major = sm->sb_dev_major;
+	  me->dev_minor = sm->sb_dev_minor;
+	  me->root = obstack_copy0 (&table->string_obstack,
+				    sm->str + sm->mnt_root,
+				    strlen (sm->str + sm->mnt_root));
+	  me->mount_point = obstack_copy0 (&table->string_obstack,
+					   sm->str + sm->mnt_point,
+					   strlen (sm->str + sm->mnt_point));
+	  me->fs_type = obstack_copy0 (&table->string_obstack,
+				       sm->str + sm->fs_type,
+				       strlen (sm->str + sm->fs_type));
+	  /* Not fetched; the device number already identifies the file
+	     system. */
+	  me->source = obstack_copy0 (&table->string_obstack, "", 0);
+	  me->previous = NULL;
+	  me->is_bind_mount = false;
+	  mount_table_add (table, me);
+	}
+      if (res < (long)ARRAY_SIZE (ids))
+	break;
+      req.param = ids[res - 1];
+      res = syscall (SYS_listmount, &req, ids, ARRAY_SIZE (ids), 0);
+    }
+  mount_table_finish (table);
+  /* Don't use a truncated table; the caller will read mountinfo_path
+     instead. */
+  if (res < 0)
+    return -1;
+  return 0;
+}
+#endif
+
+/* Read mount information from mountinfo_path, replace contents of TABLE.
+   Return 0 if OK, -1 on error. */
+static int
+read_mount_entries (struct mount_table *table)
 {
   FILE *f;
   struct mount *me;
 
+#ifdef USE_LISTMOUNT
+  /* The system calls can only describe our own mount namespace */
+  if (strcmp (mountinfo_path, MOUNTINFO_PATH) == 0
+      && read_mount_entries_listmount (table) == 0)
+    return 0;
+#endif
   f = fopen (mountinfo_path, "r");
   if (f == NULL)
     return -1;
-  obstack_free (&mount_data_obstack, mount_data_mark);
-  mount_data_mark = obstack_alloc (&mount_data_obstack, 0);
-  obstack_free (&mount_string_obstack, mount_string_mark);
-  mount_string_mark = obstack_alloc (&mount_string_obstack, 0);
-  obstack_free (&mount_list_obstack, mount_entries);
-  while ((me = read_mount_entry (f)) != NULL)
-    {
-      if (conf_debug_pruning != false)
-	/* This is debuging output, don't mark anything for translation */
-	fprintf (stderr,
-		 " `%s' (%d on %d) is `%s' of `%s' (%u:%u), type `%s'\n",
-		 me->mount_point, me->id, me->parent_id, me->root, me->source,
-		 me->dev_major, me->dev_minor, me->fs_type);
-      obstack_ptr_grow (&mount_list_obstack, me);
-    }
+  mount_table_clear (table);
+  while ((me = read_mount_entry (table, f)) != NULL)
+    mount_table_add (table, me);
   fclose (f);
-  num_mount_entries = OBSTACK_OBJECT_SIZE (&mount_list_obstack)
-    / sizeof (*mount_entries);
-  mount_entries = obstack_finish (&mount_list_obstack);
+  mount_table_finish (table);
   return 0;
 }
 
  /* Bind mount path list maintenace and top-level interface. */
 
+/* Check mountinfo_path for changes only once per this many bind mount
+   lookups */
+enum { BIND_MOUNT_POLL_INTERVAL = 64 };
+
 /* mountinfo_path file descriptor, or -1 */
 static int mountinfo_fd;
 
@@ -304,71 +485,206 @@ cmp_id_mount_entry (const void *xa, const void *xb)
   return cmp_ints (*a, ((struct mount *)*b)->id);
 }
 
-/* Rebuild bind_mount_paths */
+/* Are A and B, which have the same ID, the same mount? */
+static bool
+mount_entries_equal (const struct mount *a, const struct mount *b)
+{
+  return (a->parent_id == b->parent_id && a->dev_major == b->dev_major
+	  && a->dev_minor == b->dev_minor && strcmp (a->root, b->root) == 0
+	  && strcmp (a->mount_point, b->mount_point) == 0
+	  && strcmp (a->fs_type, b->fs_type) == 0
+	  && strcmp (a->source, b->source) == 0);
+}
+
+/* Is ME, which is mounted on PARENT, a bind mount? */
+static bool
+mount_is_bind_mount (const struct mount *me, const struct mount *parent)
+{
+  size_t p_mount_len, p_root_len;
+
+  if (me->dev_major != parent->dev_major
+      || me->dev_minor != parent->dev_minor
+      || strcmp (me->fs_type, parent->fs_type) != 0
+      || strcmp (me->source, parent->source) != 0)
+    return false;
+  /* We have two mounts from the same device.  Is it a no-op bind mount? */
+  p_mount_len = strlen (parent->mount_point);
+  p_root_len = strlen (parent->root);
+  /* parent->mount_point should always be a prefix of me->mount_point, don't
+     take any chances. */
+  return (strncmp (me->mount_point, parent->mount_point, p_mount_len) != 0
+	  || strncmp (me->root, parent->root, p_root_len) != 0
+	  || strcmp (me->mount_point + p_mount_len,
+		     me->root + p_root_len) != 0);
+}
+
+/* Sort TABLE by ID, unless it already is sorted (which is the usual case) */
 static void
+mount_table_sort (struct mount_table *table)
+{
+  size_t i;
+
+  for (i = 1; i < table->num_entries; i++)
+    {
+      if (cmp_mount_entry_pointers (table->entries + i - 1,
+				    table->entries + i) > 0)
+	{
+	  qsort (table->entries, table->num_entries, sizeof (*table->entries),
+		 cmp_mount_entry_pointers);
+	  break;
+	}
+    }
+}
+
+/* Compare current_mounts with previous_mounts, set the "previous" and
+   "is_bind_mount" fields of all entries in current_mounts.
+   Return true if the set of bind mount paths has changed. */
+static bool
+diff_mount_tables (void)
+{
+  struct mount_table *cur, *prev;
+  size_t i, j;
+  bool changed;
+
+  cur = current_mounts;
+  prev = previous_mounts;
+  /* Both tables are sorted by ID, so a single merge pass finds the entries
+     that have not changed. */
+  j = 0;
+  for (i = 0; i < cur->num_entries; i++)
+    {
+      struct mount *me;
+
+      me = cur->entries[i];
+      while (j < prev->num_entries
+	     && ((struct mount *)prev->entries[j])->id < me->id)
+	j++;
+      if (j < prev->num_entries
+	  && mount_entries_equal (me, prev->entries[j]))
+	me->previous = prev->entries[j];
+    }
+  changed = false;
+  for (i = 0; i < cur->num_entries; i++)
+    {
+      struct mount *me, *parent;
+      void **pp;
+
+      me = cur->entries[i];
+      pp = bsearch (&me->parent_id, cur->entries, cur->num_entries,
+		    sizeof (*cur->entries), cmp_id_mount_entry);
+      if (pp == NULL)
+	parent = NULL;
+      else
+	parent = *pp;
+      if (me->previous != NULL
+	  && (parent == NULL || parent->previous != NULL))
+	/* Neither the mount nor its parent have changed, reuse the result. */
+	me->is_bind_mount = me->previous->is_bind_mount;
+      else
+	me->is_bind_mount = (parent != NULL
+			     && mount_is_bind_mount (me, parent));
+      if (me->is_bind_mount != false)
+	{
+	  cur->num_bind_mounts++;
+	  if (me->previous == NULL || me->previous->is_bind_mount == false)
+	    changed = true;
+	}
+    }
+  /* Every bind mount in CUR had a bind mount counterpart with the same
+     mount point in PREV; if the counts are the same as well, no bind mount
+     has disappeared. */
+  if (cur->num_bind_mounts != prev->num_bind_mounts)
+    changed = true;
+  return changed;
+}
+
+/* Rebuild bind_mount_paths, if mountinfo_path has changed in a relevant way.
+   Return true if bind_mount_paths was modified. */
+static bool
 rebuild_bind_mount_paths (void)
 {
+  struct mount_table *table;
   size_t i;
 
+  PROBE0 (mount__rebuild__start);
   if (conf_debug_pruning != false)
     /* This is debuging output, don't mark anything for translation */
     fprintf (stderr, "Rebuilding bind_mount_paths:\n");
-  if (read_mount_entries () != 0)
-    return;
+  /* Read into the older table, keeping the current one for comparison. */
+  if (read_mount_entries (previous_mounts) != 0)
+    {
+      PROBE1 (mount__rebuild__end, 0);
+      return false;
+    }
+  table = previous_mounts;
+  previous_mounts = current_mounts;
+  current_mounts = table;
+  /* Sort by ID to allow quick lookup */
+  mount_table_sort (table);
+  if (diff_mount_tables () == false)
+    {
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "...bind mounts unchanged\n");
+      PROBE1 (mount__rebuild__end, 0);
+      return false;
+    }
   if (conf_debug_pruning != false)
     /* This is debuging output, don't mark anything for translation */
     fprintf (stderr, "Matching bind_mount_paths:\n");
   obstack_free (&bind_mount_paths_obstack, bind_mount_paths_mark);
   bind_mount_paths_mark = obstack_alloc (&bind_mount_paths_obstack, 0);
   bind_mount_paths.len = 0;
-  /* Sort by ID to allow quick lookup */
-  qsort (mount_entries, num_mount_entries, sizeof (*mount_entries),
-	 cmp_mount_entry_pointers);
-  for (i = 0; i < num_mount_entries; i++)
+  for (i = 0; i < table->num_entries; i++)
     {
-      struct mount *me, *parent;
-      void **pp;
+      struct mount *me;
 
-      me = mount_entries[i];
-      pp = bsearch (&me->parent_id, mount_entries, num_mount_entries,
-		    sizeof (*mount_entries), cmp_id_mount_entry);
-      if (pp == NULL)
-	continue;
-      parent = *pp;
-      if (me->dev_major == parent->dev_major
-	  && me->dev_minor == parent->dev_minor
-	  && strcmp (me->fs_type, parent->fs_type) == 0
-	  && strcmp (me->source, parent->source) == 0)
+      me = table->entries[i];
+      if (me->is_bind_mount != false)
 	{
-	  /* We have two mounts from the same device.  Is it a no-op bind
-	     mount? */
-	  size_t p_mount_len, p_root_len;
-
-	  p_mount_len = strlen (parent->mount_point);
-	  p_root_len = strlen (parent->root);
-	  /* parent->mount_point should always be a prefix of me->mount_point,
-	     don't take any chances. */
-	  if (strncmp (me->mount_point, parent->mount_point, p_mount_len) != 0
-	      || strncmp (me->root, parent->root, p_root_len) != 0
-	      || strcmp (me->mount_point + p_mount_len,
-			 me->root + p_root_len) != 0)
-	    {
-	      char *copy;
-
-	      if (conf_debug_pruning != false)
-		/* This is debuging output, don't mark anything for
-		   translation */
-		fprintf (stderr, " => adding `%s'\n", me->mount_point);
-	      copy = obstack_copy (&bind_mount_paths_obstack, me->mount_point,
-				   strlen (me->mount_point) + 1);
-	      string_list_append (&bind_mount_paths, copy);
-	    }
+	  char *copy;
+
+	  if (conf_debug_pruning != false)
+	    /* This is debuging output, don't mark anything for translation */
+	    fprintf (stderr, " => adding `%s'\n", me->mount_point);
+	  copy = obstack_copy (&bind_mount_paths_obstack, me->mount_point,
+			       strlen (me->mount_point) + 1);
+	  string_list_append (&bind_mount_paths, copy);
 	}
     }
   if (conf_debug_pruning != false)
     /* This is debuging output, don't mark anything for translation */
     fprintf (stderr, "...done\n");
   string_list_dir_path_sort (&bind_mount_paths);
+  PROBE1 (mount__rebuild__end, 1);
+  return true;
+}
+
+/* Reread mountinfo_path if it has changed since the last call.
+   Return false if the mount table could not be checked. */
+static bool
+check_mount_changes (void)
+{
+  /* Number of calls left before checking mountinfo_path for changes */
+  static unsigned poll_countdown; /* = 0; */
+
+  /* A poll () for each directory is a noticeable cost on hosts where mounts
+     change all the time, and a mount that changes while we are scanning is a
+     race we can't avoid anyway; so only check for changes in batches. */
+  if (poll_countdown == 0)
+    {
+      struct pollfd pfd;
+
+      poll_countdown = BIND_MOUNT_POLL_INTERVAL;
+      pfd.fd = mountinfo_fd;
+      pfd.events = POLLPRI;
+      if (poll (&pfd, 1, 0) < 0)
+	return false;
+      if ((pfd.revents & POLLPRI) != 0 && rebuild_bind_mount_paths ())
+	bind_mount_paths_index = 0;
+    }
+  poll_countdown--;
+  return true;
 }
 
 /* Return true if PATH is a destination of a bind mount.
@@ -376,24 +692,42 @@ rebuild_bind_mount_paths (void)
 bool
 is_bind_mount (const char *path)
 {
-  struct pollfd pfd;
-
   /* Unfortunately (mount --bind $path $path/subdir) would leave st_dev
      unchanged between $path and $path/subdir, so we must keep reparsing
      mountinfo_path each time it changes. */
-  pfd.fd = mountinfo_fd;
-  pfd.events = POLLPRI;
-  if (poll (&pfd, 1, 0) < 0)
+  if (check_mount_changes () == false)
     return false;
-  if ((pfd.revents & POLLPRI) != 0)
-    {
-      rebuild_bind_mount_paths ();
-      bind_mount_paths_index = 0;
-    }
   return string_list_contains_dir_path (&bind_mount_paths,
 					&bind_mount_paths_index, path);
 }
 
+/* Return true if the mount with MOUNT_ID (as used in MOUNTINFO_PATH) is
+   a bind mount.  (Bind mounts "to self" are ignored.) */
+bool
+is_bind_mount_id (int mount_id)
+{
+  void **pp;
+
+  if (check_mount_changes () == false)
+    return false;
+  pp = bsearch (&mount_id, current_mounts->entries,
+		current_mounts->num_entries, sizeof (*current_mounts->entries),
+		cmp_id_mount_entry);
+  if (pp == NULL)
+    {
+      /* The mount is newer than our copy of mountinfo_path, don't wait for
+	 the next scheduled check. */
+      if (rebuild_bind_mount_paths ())
+	bind_mount_paths_index = 0;
+      pp = bsearch (&mount_id, current_mounts->entries,
+		    current_mounts->num_entries,
+		    sizeof (*current_mounts->entries), cmp_id_mount_entry);
+      if (pp == NULL)
+	return false;
+    }
+  return ((struct mount *)*pp)->is_bind_mount;
+}
+
 /* Initialize state for is_bind_mount(), to read data from MOUNTINFO. */
 void
 bind_mount_init (const char *mountinfo)
@@ -408,3 +742,20 @@ bind_mount_init (const char *mountinfo)
     return;
   rebuild_bind_mount_paths ();
 }
+
+/* Reopen the mount information file in a child process after fork ().  A
+   mount change is reported only once for an open file description, so the
+   child must not share it with its parent. */
+void
+bind_mount_reinit (void)
+{
+  if (mountinfo_fd != -1)
+    close (mountinfo_fd);
+  mountinfo_fd = open (mountinfo_path, O_RDONLY);
+  if (mountinfo_fd == -1)
+    return;
+  /* The new file descriptor does not report changes that happened before it
+     was opened. */
+  if (rebuild_bind_mount_paths ())
+    bind_mount_paths_index = 0;
+}
@@ -29,7 +29,14 @@ Author: Miloslav Trmac <mitr@redhat.com> */
    (Bind mounts "to self" are ignored.) */
 extern bool is_bind_mount (const char *path);
 
+/* Return true if the mount with MOUNT_ID (as used in MOUNTINFO_PATH) is
+   a bind mount.  (Bind mounts "to self" are ignored.) */
+extern bool is_bind_mount_id (int mount_id);
+
 /* Initialize state for is_bind_mount(), to read data from MOUNTINFO. */
 extern void bind_mount_init (const char *mountinfo);
 
+/* Reopen the mount information file in a child process after fork (). */
+extern void bind_mount_reinit (void);
+
 #endif
@@ -20,6 +20,7 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -53,9 +54,70 @@ bool conf_prune_bind_mounts; /* = false; */
 /* true if pruning debug output was requested */
 bool conf_debug_pruning; /* = false; */
 
+/* true if memory use debug output was requested */
+bool conf_debug_memory; /* = false; */
+
+/* true if throttling debug output was requested */
+bool conf_debug_throttle; /* = false; */
+
+/* Seconds added to the time when revalidating current directories */
+unsigned long conf_debug_scan_time; /* = 0; */
+
+/* true if subdirectories should be looked up in inode number order */
+bool conf_inode_order; /* = false; */
+
+/* Maximum number of directories checked per second, or 0 if unlimited */
+unsigned long conf_max_dir_rate; /* = 0; */
+
+/* Maximum I/O pressure in percent, or 0 if unlimited */
+unsigned long conf_max_io_pressure; /* = 0; */
+
+/* Maximum memory used for directory entries, or 0 if unlimited */
+size_t conf_max_memory; /* = 0; */
+
+/* Maximum number of mounted filesystems read in parallel, or 0 to read them
+   only in the main process */
+unsigned long conf_mount_workers; /* = 0; */
+
+/* Maximum number of directories read ahead of the one being scanned, or 0 to
+   read directories only when scanning them */
+unsigned long conf_prefetch; /* = 0; */
+
+/* true if only changes relative to the database should be written */
+bool conf_delta; /* = false; */
+
+/* Absolute path to the change log to write, or NULL */
+const char *conf_changelog; /* = NULL; */
+
+/* Absolute path to the scan report to write, or NULL */
+const char *conf_report; /* = NULL; */
+
+/* Absolute path to the metrics file to write, or NULL */
+const char *conf_metrics; /* = NULL; */
+
+/* Interval between checkpoints in seconds, or 0 to write no checkpoints */
+unsigned long conf_checkpoint_interval; /* = 0; */
+
+/* true if a locked database should be waited for instead of failing */
+bool conf_coalesce; /* = false; */
+
+/* Interval between database updates in seconds, or 0 to update only once */
+unsigned long conf_watch_interval; /* = 0; */
+
+/* Number of runs in which each top-level directory is checked once, or 0 to
+   check all of them in every run */
+unsigned long conf_stagger; /* = 0; */
+
+/* Maximum time spent reading directories in seconds, or 0 if unlimited */
+unsigned long conf_time_budget; /* = 0; */
+
 /* Root of the directory tree to store in the database (canonical) */
 char *conf_scan_root; /* = NULL; */
 
+/* The only subtree of conf_scan_root to check for changes (canonical), or
+   NULL to check everything */
+char *conf_subtree; /* = NULL; */
+
 /* Absolute (not necessarily canonical) path to the database */
 const char *conf_output; /* = NULL; */
 
@@ -66,6 +128,51 @@ bool conf_verbose; /* = false; */
 const char *conf_block;
 size_t conf_block_size;
 
+/* Parse a STR, store the parsed size in bytes, with an optional K, M or G
+   suffix, to DEST; return 0 if OK, -1 on error. */
+static int
+parse_size (size_t *dest, const char *str)
+{
+  unsigned long long val;
+  char *end;
+  unsigned shift;
+
+  if (!isdigit ((unsigned char)*str))
+    return -1;
+  errno = 0;
+  val = strtoull (str, &end, 10);
+  if (errno != 0)
+    return -1;
+  switch (*end)
+    {
+    case 0:
+      shift = 0;
+      break;
+
+    case 'k': case 'K':
+      shift = 10;
+      end++;
+      break;
+
+    case 'm': case 'M':
+      shift = 20;
+      end++;
+      break;
+
+    case 'g': case 'G':
+      shift = 30;
+      end++;
+      break;
+
+    default:
+      return -1;
+    }
+  if (*end != 0 || val > SIZE_MAX >> shift)
+    return -1;
+  *dest = (size_t)val << shift;
+  return 0;
+}
+
 /* Parse a STR, store the parsed boolean value to DEST;
    return 0 if OK, -1 on error. */
 static int
@@ -440,11 +547,35 @@ help (void)
 	    "  -f, --add-prunefs FS           omit also FS\n"
 	    "  -n, --add-prunenames NAMES     omit also NAMES\n"
 	    "  -e, --add-prunepaths PATHS     omit also PATHS\n"
+	    "      --changelog FILE           write added and removed paths to "
+	    "FILE\n"
+	    "      --checkpoint SECONDS       save progress to resume an "
+	    "interrupted\n"
+	    "                                 update\n"
+	    "      --coalesce                 wait for a running updatedb and "
+	    "reuse its\n"
+	    "                                 result\n"
 	    "  -U, --database-root PATH       the subtree to store in "
 	    "database (default \"/\")\n"
+	    "      --delta                    write only changes to a delta "
+	    "database\n"
 	    "  -h, --help                     print this help\n"
+	    "      --inode-order              look up subdirectories in inode "
+	    "order\n"
+	    "      --max-dir-rate N           check at most N directories per "
+	    "second\n"
+	    "      --max-io-pressure PERCENT  pause while I/O pressure exceeds "
+	    "PERCENT\n"
+	    "      --max-memory SIZE          limit memory used for directory "
+	    "entries\n"
+	    "      --metrics FILE             write Prometheus metrics of the "
+	    "update to FILE\n"
+	    "      --mount-workers N          read up to N mounted filesystems "
+	    "in parallel\n"
 	    "  -o, --output FILE              database to update (default\n"
 	    "                                 `%s')\n"
+	    "      --prefetch N               read up to N directories ahead "
+	    "in parallel\n"
 	    "      --prune-bind-mounts FLAG   omit bind mounts (default "
 	    "\"no\")\n"
 	    "      --prunefs FS               filesystems to omit from "
@@ -452,12 +583,24 @@ help (void)
 	    "      --prunenames NAMES         directory names to omit from "
 	    "database\n"
 	    "      --prunepaths PATHS         paths to omit from database\n"
+	    "      --report FILE              write statistics of the update "
+	    "to FILE\n"
 	    "  -l, --require-visibility FLAG  check visibility before "
 	    "reporting files\n"
 	    "                                 (default \"yes\")\n"
+	    "      --stagger N                check only every N-th top-level "
+	    "directory for\n"
+	    "                                 changes, in rotation\n"
+	    "      --subtree PATH             check only PATH for changes\n"
+	    "      --time-budget SECONDS      stop reading directories after "
+	    "SECONDS\n"
 	    "  -v, --verbose                  print paths of files as they "
 	    "are found\n"
 	    "  -V, --version                  print version information\n"
+	    "      --watch SECONDS            keep updating the database, "
+	    "checking\n"
+	    "                                 only changed directories if "
+	    "possible\n"
 	    "\n"
 	    "The configuration defaults to values read from\n"
 	    "`%s'.\n"), DBFILE, UPDATEDB_CONF);
@@ -492,35 +635,74 @@ prepend_cwd (const char *path)
 static void
 parse_arguments (int argc, char *argv[])
 {
-  enum { OPT_DEBUG_PRUNING = CHAR_MAX + 1 };
+  enum
+    {
+      OPT_CHANGELOG = CHAR_MAX + 1, OPT_CHECKPOINT, OPT_COALESCE,
+      OPT_DEBUG_MEMORY, OPT_DEBUG_PRUNING, OPT_DEBUG_SCAN_TIME,
+      OPT_DEBUG_THROTTLE, OPT_DELTA, OPT_INODE_ORDER, OPT_MAX_DIR_RATE, OPT_MAX_IO_PRESSURE, OPT_MAX_MEMORY,
+      OPT_METRICS, OPT_MOUNT_WORKERS, OPT_PREFETCH, OPT_REPORT, OPT_STAGGER,
+      OPT_SUBTREE, OPT_TIME_BUDGET, OPT_WATCH
+    };
 
   static const struct option options[] =
     {
       { "add-prunefs", required_argument, NULL, 'f' },
       { "add-prunenames", required_argument, NULL, 'n' },
       { "add-prunepaths", required_argument, NULL, 'e' },
+      { "changelog", required_argument, NULL, OPT_CHANGELOG },
+      { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+      { "coalesce", no_argument, NULL, OPT_COALESCE },
       { "database-root", required_argument, NULL, 'U' },
+      { "debug-memory", no_argument, NULL, OPT_DEBUG_MEMORY },
       { "debug-pruning", no_argument, NULL, OPT_DEBUG_PRUNING },
+      { "debug-scan-time", required_argument, NULL, OPT_DEBUG_SCAN_TIME },
+      { "debug-throttle", no_argument, NULL, OPT_DEBUG_THROTTLE },
+      { "delta", no_argument, NULL, OPT_DELTA },
       { "help", no_argument, NULL, 'h' },
+      { "inode-order", no_argument, NULL, OPT_INODE_ORDER },
+      { "max-dir-rate", required_argument, NULL, OPT_MAX_DIR_RATE },
+      { "max-io-pressure", required_argument, NULL, OPT_MAX_IO_PRESSURE },
+      { "max-memory", required_argument, NULL, OPT_MAX_MEMORY },
+      { "metrics", required_argument, NULL, OPT_METRICS },
+      { "mount-workers", required_argument, NULL, OPT_MOUNT_WORKERS },
       { "output", required_argument, NULL, 'o' },
+      { "prefetch", required_argument, NULL, OPT_PREFETCH },
       { "prune-bind-mounts", required_argument, NULL, 'B' },
       { "prunefs", required_argument, NULL, 'F' },
       { "prunenames", required_argument, NULL, 'N' },
       { "prunepaths", required_argument, NULL, 'P' },
+      { "report", required_argument, NULL, OPT_REPORT },
       { "require-visibility", required_argument, NULL, 'l' },
+      { "stagger", required_argument, NULL, OPT_STAGGER },
+      { "subtree", required_argument, NULL, OPT_SUBTREE },
+      { "time-budget", required_argument, NULL, OPT_TIME_BUDGET },
       { "verbose", no_argument, NULL, 'v' },
       { "version", no_argument, NULL, 'V' },
+      { "watch", required_argument, NULL, OPT_WATCH },
       { NULL, 0, NULL, 0 }
     };
 
   bool prunefs_changed, prunenames_changed, prunepaths_changed;
-  bool got_prune_bind_mounts, got_visibility;
-
+  bool got_checkpoint, got_debug_scan_time, got_max_dir_rate;
+  bool got_max_io_pressure, got_max_memory, got_mount_workers, got_prefetch;
+  bool got_prune_bind_mounts, got_stagger, got_time_budget, got_visibility;
+  bool got_watch;
+
+  got_checkpoint = false;
+  got_debug_scan_time = false;
+  got_max_dir_rate = false;
+  got_max_io_pressure = false;
+  got_max_memory = false;
+  got_mount_workers = false;
+  got_prefetch = false;
   prunefs_changed = false;
   prunenames_changed = false;
   prunepaths_changed = false;
   got_prune_bind_mounts = false;
+  got_stagger = false;
+  got_time_budget = false;
   got_visibility = false;
+  got_watch = false;
   for (;;)
     {
       int opt, idx;
@@ -633,10 +815,214 @@ parse_arguments (int argc, char *argv[])
 	  conf_verbose = true;
 	  break;
 
+	case OPT_CHANGELOG:
+	  if (conf_changelog != NULL)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "changelog");
+	  conf_changelog = optarg;
+	  break;
+
+	case OPT_CHECKPOINT:
+	  {
+	    char *end;
+
+	    if (got_checkpoint != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"), "checkpoint");
+	    got_checkpoint = true;
+	    errno = 0;
+	    conf_checkpoint_interval = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_checkpoint_interval == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "checkpoint");
+	    break;
+	  }
+
+	case OPT_COALESCE:
+	  conf_coalesce = true;
+	  break;
+
+	case OPT_DEBUG_MEMORY:
+	  conf_debug_memory = true;
+	  break;
+
 	case OPT_DEBUG_PRUNING:
 	  conf_debug_pruning = true;
 	  break;
 
+	case OPT_DEBUG_SCAN_TIME:
+	  {
+	    char *end;
+
+	    if (got_debug_scan_time != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"),
+		     "debug-scan-time");
+	    got_debug_scan_time = true;
+	    errno = 0;
+	    conf_debug_scan_time = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_debug_scan_time == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "debug-scan-time");
+	    break;
+	  }
+
+	case OPT_DEBUG_THROTTLE:
+	  conf_debug_throttle = true;
+	  break;
+
+	case OPT_DELTA:
+	  conf_delta = true;
+	  break;
+
+	case OPT_INODE_ORDER:
+	  conf_inode_order = true;
+	  break;
+
+	case OPT_MAX_DIR_RATE:
+	  {
+	    char *end;
+
+	    if (got_max_dir_rate != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"),
+		     "max-dir-rate");
+	    got_max_dir_rate = true;
+	    errno = 0;
+	    conf_max_dir_rate = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_max_dir_rate == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "max-dir-rate");
+	    break;
+	  }
+
+	case OPT_MAX_IO_PRESSURE:
+	  {
+	    char *end;
+
+	    if (got_max_io_pressure != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"),
+		     "max-io-pressure");
+	    got_max_io_pressure = true;
+	    errno = 0;
+	    conf_max_io_pressure = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_max_io_pressure == 0 || conf_max_io_pressure > 100)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "max-io-pressure");
+	    break;
+	  }
+
+	case OPT_MAX_MEMORY:
+	  if (got_max_memory != false)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "max-memory");
+	  got_max_memory = true;
+	  if (parse_size (&conf_max_memory, optarg) != 0)
+	    error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		   "max-memory");
+	  break;
+
+	case OPT_METRICS:
+	  if (conf_metrics != NULL)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "metrics");
+	  conf_metrics = optarg;
+	  break;
+
+	case OPT_MOUNT_WORKERS:
+	  {
+	    char *end;
+
+	    if (got_mount_workers != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"),
+		     "mount-workers");
+	    got_mount_workers = true;
+	    errno = 0;
+	    conf_mount_workers = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_mount_workers == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "mount-workers");
+	    break;
+	  }
+
+	case OPT_PREFETCH:
+	  {
+	    char *end;
+
+	    if (got_prefetch != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"), "prefetch");
+	    got_prefetch = true;
+	    errno = 0;
+	    conf_prefetch = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_prefetch == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "prefetch");
+	    break;
+	  }
+
+	case OPT_REPORT:
+	  if (conf_report != NULL)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "report");
+	  conf_report = optarg;
+	  break;
+
+	case OPT_STAGGER:
+	  {
+	    char *end;
+
+	    if (got_stagger != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"), "stagger");
+	    got_stagger = true;
+	    errno = 0;
+	    conf_stagger = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_stagger == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "stagger");
+	    break;
+	  }
+
+	case OPT_SUBTREE:
+	  if (conf_subtree != NULL)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "subtree");
+	  conf_subtree = canonicalize_file_name (optarg);
+	  if (conf_subtree == NULL)
+	    error (EXIT_FAILURE, errno, _("invalid value `%s' of --%s"), optarg,
+		   "subtree");
+	  break;
+
+	case OPT_TIME_BUDGET:
+	  {
+	    char *end;
+
+	    if (got_time_budget != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"), "time-budget");
+	    got_time_budget = true;
+	    errno = 0;
+	    conf_time_budget = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_time_budget == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "time-budget");
+	    break;
+	  }
+
+	case OPT_WATCH:
+	  {
+	    char *end;
+
+	    if (got_watch != false)
+	      error (EXIT_FAILURE, 0, _("--%s specified twice"), "watch");
+	    got_watch = true;
+	    errno = 0;
+	    conf_watch_interval = strtoul (optarg, &end, 10);
+	    if (!isdigit ((unsigned char)*optarg) || *end != 0 || errno != 0
+		|| conf_watch_interval == 0)
+	      error (EXIT_FAILURE, 0, _("invalid value `%s' of --%s"), optarg,
+		     "watch");
+	    break;
+	  }
+
 	default:
 	  abort ();
 	}
@@ -650,10 +1036,41 @@ parse_arguments (int argc, char *argv[])
 
       conf_scan_root = root;
     }
+  if (conf_subtree != NULL)
+    {
+      if (path_is_within (conf_subtree, conf_scan_root,
+			  strlen (conf_scan_root)) == false)
+	error (EXIT_FAILURE, 0, _("`%s' is not within the database root `%s'"),
+	       conf_subtree, conf_scan_root);
+      if (conf_watch_interval != 0)
+	error (EXIT_FAILURE, 0, _("--%s can not be used with --%s"),
+	       "subtree", "watch");
+    }
+  if (conf_stagger != 0)
+    {
+      if (conf_subtree != NULL)
+	error (EXIT_FAILURE, 0, _("--%s can not be used with --%s"),
+	       "stagger", "subtree");
+      if (conf_watch_interval != 0)
+	error (EXIT_FAILURE, 0, _("--%s can not be used with --%s"),
+	       "stagger", "watch");
+      if (conf_mount_workers != 0)
+	error (EXIT_FAILURE, 0, _("--%s can not be used with --%s"),
+	       "stagger", "mount-workers");
+    }
+  if (conf_checkpoint_interval != 0 && conf_delta != false)
+    error (EXIT_FAILURE, 0, _("--%s can not be used with --%s"), "checkpoint",
+	   "delta");
   if (conf_output == NULL)
     conf_output = DBFILE;
   if (*conf_output != '/')
     conf_output = prepend_cwd (conf_output);
+  if (conf_changelog != NULL && *conf_changelog != '/')
+    conf_changelog = prepend_cwd (conf_changelog);
+  if (conf_report != NULL && *conf_report != '/')
+    conf_report = prepend_cwd (conf_report);
+  if (conf_metrics != NULL && *conf_metrics != '/')
+    conf_metrics = prepend_cwd (conf_metrics);
 }
 
  /* Conversion of configuration for main code */
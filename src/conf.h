@@ -42,9 +42,70 @@ extern bool conf_prune_bind_mounts;
 /* true if pruning debug output was requested */
 extern bool conf_debug_pruning;
 
+/* true if memory use debug output was requested */
+extern bool conf_debug_memory;
+
+/* true if throttling debug output was requested */
+extern bool conf_debug_throttle;
+
+/* Seconds added to the time when revalidating current directories */
+extern unsigned long conf_debug_scan_time;
+
+/* true if subdirectories should be looked up in inode number order */
+extern bool conf_inode_order;
+
+/* Maximum number of directories checked per second, or 0 if unlimited */
+extern unsigned long conf_max_dir_rate;
+
+/* Maximum I/O pressure in percent, or 0 if unlimited */
+extern unsigned long conf_max_io_pressure;
+
+/* Maximum memory used for directory entries, or 0 if unlimited */
+extern size_t conf_max_memory;
+
+/* Maximum number of mounted filesystems read in parallel, or 0 to read them
+   only in the main process */
+extern unsigned long conf_mount_workers;
+
+/* Maximum number of directories read ahead of the one being scanned, or 0 to
+   read directories only when scanning them */
+extern unsigned long conf_prefetch;
+
+/* true if only changes relative to the database should be written */
+extern bool conf_delta;
+
+/* Absolute path to the change log to write, or NULL */
+extern const char *conf_changelog;
+
+/* Absolute path to the scan report to write, or NULL */
+extern const char *conf_report;
+
+/* Absolute path to the metrics file to write, or NULL */
+extern const char *conf_metrics;
+
+/* Interval between checkpoints in seconds, or 0 to write no checkpoints */
+extern unsigned long conf_checkpoint_interval;
+
+/* true if a locked database should be waited for instead of failing */
+extern bool conf_coalesce;
+
+/* Interval between database updates in seconds, or 0 to update only once */
+extern unsigned long conf_watch_interval;
+
+/* Number of runs in which each top-level directory is checked once, or 0 to
+   check all of them in every run */
+extern unsigned long conf_stagger;
+
+/* Maximum time spent reading directories in seconds, or 0 if unlimited */
+extern unsigned long conf_time_budget;
+
 /* Root of the directory tree to store in the database (canonical) */
 extern char *conf_scan_root;
 
+/* The only subtree of conf_scan_root to check for changes (canonical), or
+   NULL to check everything */
+extern char *conf_subtree;
+
 /* Absolute (not necessarily canonical) path to the database */
 extern const char *conf_output;
 
@@ -67,6 +67,20 @@ struct db_directory
 /* Followed by directory entries terminated by DBE_END, sorted by name using
    strcmp () */
 
+/* A delta database describes changes relative to a base database.  It has the
+   same format, its file name is the base file name followed by
+   DB_DELTA_SUFFIX.  Its configuration block starts with the DB_DELTA_BASE_VAR
+   variable, identifying the base file; the rest must be equal to the
+   configuration block of the base database.
+
+   A directory record in a delta replaces the record with the same path in
+   the base database.  A directory record with time_nsec equal to
+   DB_NSEC_REMOVED and no entries marks a directory that is not present any
+   more. */
+#define DB_DELTA_SUFFIX ".delta"
+#define DB_DELTA_BASE_VAR "delta_base"
+#define DB_NSEC_REMOVED 0xFFFFFFFFu
+
 /* Directory entry */
 struct db_entry
 {
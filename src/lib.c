@@ -25,11 +25,13 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "error.h"
 #include "obstack.h"
 #include "safe-read.h"
+#include "stat-time.h"
 #include "verify.h"
 #include "xalloc.h"
 
@@ -104,6 +106,16 @@ dir_path_cmp (const char *a, const char *b)
 	  - (int)dir_path_cmp_table[(unsigned char)*b]);
 }
 
+/* Return true if A is B, which has B_LEN, or a path within B */
+bool
+path_is_within (const char *a, const char *b, size_t b_len)
+{
+  if (strncmp (a, b, b_len) != 0)
+    return false;
+  return (a[b_len] == 0 || a[b_len] == '/'
+	  || (b_len != 0 && b[b_len - 1] == '/')); /* b == "/" */
+}
+
 /* Used by obstack code */
 struct _obstack_chunk *
 obstack_chunk_alloc (long size)
@@ -383,3 +395,40 @@ db_bytes_read (const struct db *db)
 {
   return db->read_bytes - (db->buf_end - db->buf_pos);
 }
+
+/* Seek DB back to OFFSET, a value of db_bytes_read () on DB, which must not
+   have been used with db_skip (), report error on failure if not DB->quiet;
+   return 0 if OK, -1 on error */
+int
+db_seek (struct db *db, off_t offset)
+{
+  off_t buf_start;
+
+  buf_start = db->read_bytes - (db->buf_end - db->buffer);
+  if (offset >= buf_start && offset <= db->read_bytes)
+    {
+      db->buf_pos = db->buffer + (offset - buf_start);
+      return 0;
+    }
+  if (lseek (db->fd, offset, SEEK_SET) != offset)
+    {
+      if (db->quiet == false)
+	error (0, errno, _("I/O error seeking in `%s'"), db->filename);
+      return -1;
+    }
+  db->read_bytes = offset;
+  db->buf_pos = db->buffer;
+  db->buf_end = db->buffer;
+  return 0;
+}
+
+/* Store identification of a database file with ST, used as the value of
+   DB_DELTA_BASE_VAR, to BUF.  A rewritten database is a new file, so the
+   identification changes even if the rest of the database is the same. */
+void
+db_delta_base_id (char *buf, const struct stat *st)
+{
+  sprintf (buf, "%ju:%ju:%jd.%09ld", (uintmax_t)st->st_ino,
+	   (uintmax_t)st->st_size, (intmax_t)st->st_mtime,
+	   (long)get_stat_mtime_ns (st));
+}
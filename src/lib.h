@@ -23,6 +23,7 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "gettext.h"
@@ -54,6 +55,9 @@ extern void dir_path_cmp_init (void);
    exactly strcmp () order: "a" < "a.b", so "a/z" < "a.b". */
 extern int dir_path_cmp (const char *a, const char *b);
 
+/* Return true if A is B, which has B_LEN, or a path within B */
+extern bool path_is_within (const char *a, const char *b, size_t b_len);
+
 /* Functions used by obstack code */
 extern struct _obstack_chunk *obstack_chunk_alloc (long size);
 
@@ -136,4 +140,16 @@ extern int db_skip (struct db *db, off_t size);
 /* Return number of bytes read from DB so far  */
 extern off_t db_bytes_read (const struct db *db);
 
+/* Seek DB back to OFFSET, a value of db_bytes_read () on DB, which must not
+   have been used with db_skip (), report error on failure if not DB->quiet;
+   return 0 if OK, -1 on error */
+extern int db_seek (struct db *db, off_t offset);
+
+/* Size of a buffer for db_delta_base_id () */
+#define DB_DELTA_BASE_ID_SIZE (4 * (sizeof (uintmax_t) * 3 + 1))
+
+/* Store identification of a database file with ST, used as the value of
+   DB_DELTA_BASE_VAR, to BUF. */
+extern void db_delta_base_id (char *buf, const struct stat *st);
+
 #endif
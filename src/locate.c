@@ -46,6 +46,8 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 
 #include "db.h"
 #include "lib.h"
+#include "metrics.h"
+#include "probes.h"
 
 /* Check file existence before reporting them */
 static bool conf_check_existence; /* = false; */
@@ -60,6 +62,9 @@ static struct string_list conf_dbpath; /* = { 0, }; */
 /* Ignore case when matching patterns */
 static bool conf_ignore_case; /* = false; */
 
+/* Metrics file to add metrics of this query to, or NULL */
+static const char *conf_metrics; /* = NULL; */
+
 /* Return only files that match all patterns */
 static bool conf_match_all_patterns; /* = false; */
 
@@ -328,13 +333,15 @@ stats_clear (void)
   stats_bytes = 0;
 }
 
-/* Print current statistics for DB */
+/* Print current statistics for DB and its DELTA, if not NULL */
 static void
-stats_print (const struct db *db)
+stats_print (const struct db *db, const struct db *delta)
 {
   uintmax_t sz;
   
   sz = db_bytes_read (db);
+  if (delta != NULL)
+    sz += db_bytes_read (delta);
   printf (_("Database %s:\n"), db->filename);
   /* The third argument of ngettext () is unsigned long; it is still better
      to have invalid grammar than truncated numbers. */
@@ -353,6 +360,11 @@ stats_print (const struct db *db)
 /* Number of matches so far */
 static uintmax_t matches_found; /* = 0; */
 
+/* Number of databases read so far, if conf_metrics */
+static uintmax_t metrics_databases_read; /* = 0; */
+/* Time spent reading databases so far in seconds, if conf_metrics */
+static double metrics_query_time; /* = 0; */
+
 /* Contains a single, usually not obstack_finish ()'ed object */
 static struct obstack path_obstack;
 
@@ -446,6 +458,7 @@ handle_path (const char *path, int *visible)
 	goto done;
     }
   /* Output */
+  PROBE1 (match, path);
   if (conf_output_count == false)
     {
       if (conf_output_quote != false)
@@ -461,21 +474,18 @@ handle_path (const char *path, int *visible)
   return 0;
 }
 
-/* Read and handle a directory in DB with HEADER (read just past struct
-   db_directory);
+/* Read and handle entries of a directory in DB with HEADER, the directory
+   name is the current object in path_obstack;
    return 0 if OK, -1 on error or reached conf_output_limit
 
    path_obstack may contain a partial object if this function returns -1. */
 static int
-handle_directory (struct db *db, const struct db_header *hdr)
+handle_directory_entries (struct db *db, const struct db_header *hdr)
 {
   size_t size, dir_name_len;
   int visible;
   void *p;
   
-  stats_directories++;
-  if (db_read_name (db, &path_obstack) != 0)
-    goto err;
   size = OBSTACK_OBJECT_SIZE (&path_obstack);
   if (size == 0)
     {
@@ -521,17 +531,231 @@ handle_directory (struct db *db, const struct db_header *hdr)
   return -1;
 }
 
+/* Read and handle a directory in DB with HEADER (read just past struct
+   db_directory);
+   return 0 if OK, -1 on error or reached conf_output_limit
+
+   path_obstack may contain a partial object if this function returns -1. */
+static int
+handle_directory (struct db *db, const struct db_header *hdr)
+{
+  stats_directories++;
+  if (db_read_name (db, &path_obstack) != 0)
+    return -1;
+  return handle_directory_entries (db, hdr);
+}
+
+/* Skip entries of a directory in DB;
+   return 0 if OK, -1 on error */
+static int
+skip_directory (struct db *db)
+{
+  for (;;)
+    {
+      struct db_entry entry;
+      void *p;
+
+      if (db_read (db, &entry, sizeof (entry)) != 0)
+	{
+	  db_report_error (db);
+	  return -1;
+	}
+      if (entry.type == DBE_END)
+	break;
+      if (db_read_name (db, &path_obstack) != 0)
+	return -1;
+      p = obstack_finish (&path_obstack);
+      obstack_free (&path_obstack, p);
+    }
+  return 0;
+}
+
+/* A database read by handle_merged_directories () */
+struct merged_db
+{
+  struct db *db;
+  struct obstack obstack;	/* Contains only path, if any */
+  char *path;			/* Path of the next directory, NULL at EOF */
+  bool removed;		      /* The next directory is a removal record */
+};
+
+/* Read the next directory header in M;
+   return 0 if OK, -1 on error */
+static int
+merged_db_next (struct merged_db *m)
+{
+  struct db_directory dir;
+  off_t offset;
+
+  if (m->path != NULL)
+    {
+      obstack_free (&m->obstack, m->path);
+      m->path = NULL;
+    }
+  offset = db_bytes_read (m->db);
+  if (db_read (m->db, &dir, sizeof (dir)) != 0)
+    {
+      if (m->db->err == 0 && db_bytes_read (m->db) == offset)
+	return 0;
+      db_report_error (m->db);
+      return -1;
+    }
+  m->removed = ntohl (dir.time_nsec) == DB_NSEC_REMOVED;
+  if (db_read_name (m->db, &m->obstack) != 0)
+    return -1;
+  obstack_1grow (&m->obstack, 0);
+  m->path = obstack_finish (&m->obstack);
+  return 0;
+}
+
+/* Read and handle directories in DB with HEADER and DELTA merged;
+   return 0 if OK, -1 on error or reached conf_output_limit
+
+   path_obstack may contain a partial object if this function returns -1. */
+static int
+handle_merged_directories (struct db *db, struct db *delta,
+			   const struct db_header *hdr)
+{
+  struct merged_db m[2];	/* m[0] is DB, m[1] is DELTA */
+  size_t i;
+  int res;
+
+  m[0].db = db;
+  m[1].db = delta;
+  res = 0;
+  for (i = 0; i < ARRAY_SIZE (m); i++)
+    {
+      obstack_init (&m[i].obstack);
+      obstack_alignment_mask (&m[i].obstack) = 0;
+      m[i].path = NULL;
+      if (res == 0)
+	res = merged_db_next (m + i);
+    }
+  while (res == 0 && (m[0].path != NULL || m[1].path != NULL))
+    {
+      struct merged_db *src;
+      int cmp;
+
+      if (m[0].path == NULL)
+	cmp = 1;
+      else if (m[1].path == NULL)
+	cmp = -1;
+      else
+	cmp = dir_path_cmp (m[0].path, m[1].path);
+      if (cmp == 0)
+	{
+	  /* Replaced by DELTA */
+	  res = skip_directory (db);
+	  if (res == 0)
+	    res = merged_db_next (m);
+	  if (res != 0)
+	    break;
+	}
+      src = cmp < 0 ? m : m + 1;
+      if (src->removed != false)
+	res = skip_directory (src->db);
+      else
+	{
+	  stats_directories++;
+	  obstack_grow (&path_obstack, src->path, strlen (src->path));
+	  res = handle_directory_entries (src->db, hdr);
+	}
+      if (res == 0)
+	res = merged_db_next (src);
+    }
+  for (i = 0; i < ARRAY_SIZE (m); i++)
+    obstack_free (&m[i].obstack, NULL);
+  return res;
+}
+
+/* Open the delta of DATABASE with ROOT and HDR, opened as FD, as DELTA;
+   return 0 if OK, -1 if there is no usable delta */
+static int
+delta_open (struct db *delta, const char *database, int fd, const char *root,
+	    const struct db_header *hdr)
+{
+  char id[DB_DELTA_BASE_ID_SIZE];
+  struct stat st, delta_st;
+  struct db_header delta_hdr;
+  char *filename, *delta_root, *prefix;
+  size_t prefix_size;
+  uint32_t conf_size;
+  int delta_fd, res;
+
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode))
+    goto err;
+  filename = xmalloc (strlen (database) + sizeof (DB_DELTA_SUFFIX));
+  sprintf (filename, "%s" DB_DELTA_SUFFIX, database);
+  delta_fd = open (filename, O_RDONLY);
+  if (delta_fd == -1)
+    goto err_filename;
+  /* The delta must be exactly as trustworthy as the database. */
+  if (fstat (delta_fd, &delta_st) != 0 || delta_st.st_uid != st.st_uid
+      || delta_st.st_gid != st.st_gid || delta_st.st_mode != st.st_mode)
+    {
+      close (delta_fd);
+      goto err_filename;
+    }
+  if (db_open (delta, &delta_hdr, delta_fd, filename, true) != 0)
+    {
+      close (delta_fd);
+      goto err_filename;
+    }
+  if (delta_hdr.check_visibility != hdr->check_visibility)
+    goto err_delta;
+  if (db_read_name (delta, &path_obstack) != 0)
+    goto err_delta;
+  obstack_1grow (&path_obstack, 0);
+  delta_root = obstack_finish (&path_obstack);
+  res = strcmp (delta_root, root);
+  obstack_free (&path_obstack, delta_root);
+  if (res != 0)
+    goto err_delta;
+  db_delta_base_id (id, &st);
+  prefix_size = sizeof (DB_DELTA_BASE_VAR) + strlen (id) + 2;
+  conf_size = ntohl (delta_hdr.conf_size);
+  if (conf_size < prefix_size)
+    goto err_delta;
+  prefix = obstack_alloc (&path_obstack, prefix_size);
+  res = db_read (delta, prefix, prefix_size);
+  if (res == 0)
+    res = (memcmp (prefix, DB_DELTA_BASE_VAR, sizeof (DB_DELTA_BASE_VAR))
+	   != 0
+	   || memcmp (prefix + sizeof (DB_DELTA_BASE_VAR), id,
+		      prefix_size - sizeof (DB_DELTA_BASE_VAR)) != 0);
+  obstack_free (&path_obstack, prefix);
+  if (res != 0)
+    goto err_delta;
+  /* The rest of the configuration block is equal to the base database. */
+  if (db_skip (delta, conf_size - prefix_size) != 0)
+    goto err_delta;
+  delta->quiet = conf_quiet;
+  return 0;
+
+ err_delta:
+  db_close (delta);
+ err_filename:
+  free (filename);
+ err:
+  return -1;
+}
+
 /* Read and handle DATABASE, opened as FD;
    PRIVILEGED is non-zero if db_is_privileged() */
 static void
 handle_db (int fd, const char *database, bool privileged)
 {
-  struct db db;
+  struct db db, delta;
   struct db_header hdr;
   struct db_directory dir;
   void *p;
+  double start;
   int visible;
+  bool have_delta;
 
+  PROBE1 (db__start, database);
+  start = conf_metrics != NULL ? metrics_now () : 0;
+  have_delta = false;
   if (db_open (&db, &hdr, fd, database, conf_quiet) != 0)
     {
       close(fd);
@@ -541,35 +765,55 @@ handle_db (int fd, const char *database, bool privileged)
   if (db_read_name (&db, &path_obstack) != 0)
     goto err_path;
   obstack_1grow (&path_obstack, 0);
+  p = obstack_finish (&path_obstack);
+  have_delta = (strcmp (database, "-") != 0
+		&& delta_open (&delta, database, fd, p, &hdr) == 0);
   if (privileged == false)
     hdr.check_visibility = 0;
   visible = hdr.check_visibility ? -1 : 1;
-  p = obstack_finish (&path_obstack);
   if (handle_path (p, &visible) != 0)
     goto err_free;
   obstack_free (&path_obstack, p);
   if (db_skip (&db, ntohl (hdr.conf_size)) != 0)
     goto err_path;
-  while (db_read (&db, &dir, sizeof (dir)) == 0)
+  if (have_delta != false)
     {
-      if (handle_directory (&db, &hdr) != 0)
+      if (handle_merged_directories (&db, &delta, &hdr) != 0)
 	goto err_path;
     }
-  if (db.err != 0)
+  else
     {
-      db_report_error (&db);
-      goto err_path;
+      while (db_read (&db, &dir, sizeof (dir)) == 0)
+	{
+	  if (handle_directory (&db, &hdr) != 0)
+	    goto err_path;
+	}
+      if (db.err != 0)
+	{
+	  db_report_error (&db);
+	  goto err_path;
+	}
     }
   if (conf_statistics != false)
-    stats_print (&db);
+    stats_print (&db, have_delta != false ? &delta : NULL);
   /* Fall through */
  err_path:
   p = obstack_finish (&path_obstack);
  err_free:
   obstack_free (&path_obstack, p);
+  if (have_delta != false)
+    {
+      free ((char *)delta.filename);
+      db_close (&delta);
+    }
   db_close (&db);
  err:
-  ;
+  if (conf_metrics != NULL)
+    {
+      metrics_databases_read++;
+      metrics_query_time += metrics_now () - start;
+    }
+  PROBE2 (db__end, database, matches_found);
 }
 
  /* Main program */
@@ -634,6 +878,8 @@ help (void)
 	    "patterns\n"
 	    "  -l, --limit, -n LIMIT  limit output (or counting) to LIMIT "
 	    "entries\n"
+	    "      --metrics FILE     add Prometheus metrics of the query to "
+	    "FILE\n"
 	    "  -m, --mmap             ignored, for backward compatibility\n"
 	    "  -P, --nofollow, -H     don't follow trailing symbolic links "
 	    "when checking file\n"
@@ -670,6 +916,7 @@ parse_options (int argc, char *argv[])
       { "help", no_argument, NULL, 'h' },
       { "ignore-case", no_argument, NULL, 'i' },
       { "limit", required_argument, NULL, 'l' },
+      { "metrics", required_argument, NULL, 'M' },
       { "mmap", no_argument, NULL, 'm' },
       { "quiet", no_argument, NULL, 'q' },
       { "nofollow", no_argument, NULL, 'P' },
@@ -717,6 +964,12 @@ parse_options (int argc, char *argv[])
 	  conf_check_follow_trailing = false;
 	  break;
 
+	case 'M':
+	  if (conf_metrics != NULL)
+	    error (EXIT_FAILURE, 0, _("--%s specified twice"), "metrics");
+	  conf_metrics = optarg;
+	  break;
+
 	case 'L':
 	  if (got_follow != false)
 	    error (EXIT_FAILURE, 0,
@@ -949,6 +1202,42 @@ drop_setgid (void)
     error (EXIT_FAILURE, errno, _("can not drop privileges"));
 }
 
+/* Add metrics of this query to conf_metrics.  Privileges must already be
+   dropped. */
+static void
+write_metrics (void)
+{
+  static const double bounds[] =
+    {
+      0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+  static const struct metrics_buckets buckets =
+    {
+      bounds, ARRAY_SIZE (bounds)
+    };
+
+  struct metrics m;
+  size_t family;
+
+  metrics_init (&m);
+  family = metrics_family (&m, "locate_queries_total", METRICS_COUNTER,
+			   "Queries.");
+  metrics_add (&m, family, "", 1);
+  family = metrics_family (&m, "locate_databases_read_total", METRICS_COUNTER,
+			   "Databases read by queries.");
+  metrics_add (&m, family, "", metrics_databases_read);
+  family = metrics_family (&m, "locate_matches_total", METRICS_COUNTER,
+			   "Entries found by queries.");
+  metrics_add (&m, family, "", matches_found);
+  family = metrics_family (&m, "locate_query_duration_seconds",
+			   METRICS_HISTOGRAM,
+			   "Time spent reading databases in a query.");
+  metrics_observe (&m, family, &buckets, metrics_query_time, true);
+  if (metrics_write (&m, conf_metrics, true) != 0)
+    error (0, errno, _("I/O error while writing to `%s'"), conf_metrics);
+  metrics_free (&m);
+}
+
 /* Handle a conf_dbpath ENTRY, drop privileges when they are no longer
    necessary. */
 static void
@@ -1020,6 +1309,7 @@ main (int argc, char *argv[])
   parse_options (argc, argv);
   parse_arguments (argc, argv);
   finish_dbpath ();
+  dir_path_cmp_init ();
   obstack_init (&path_obstack);
   obstack_alignment_mask (&path_obstack) = 0;
   obstack_init (&uc_obstack);
@@ -1042,6 +1332,12 @@ main (int argc, char *argv[])
       handle_dbpath_entry (conf_dbpath.entries[i]);
     }
  done:
+  if (conf_metrics != NULL)
+    {
+      /* Don't create or modify files with GROUPNAME privileges. */
+      drop_setgid ();
+      write_metrics ();
+    }
   if (conf_output_count != false)
     printf ("%ju\n", matches_found);
   if (conf_statistics != false || matches_found != 0)
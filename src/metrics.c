@@ -0,0 +1,428 @@
+/* Metrics in the Prometheus text exposition format.
+
+Copyright (C) 2026 Red Hat, Inc. All rights reserved.
+This copyrighted material is made available to anyone wishing to use, modify,
+copy, or redistribute it subject to the terms and conditions of the GNU General
+Public License v.2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Miloslav Trmac <mitr@redhat.com> */
+#include <config.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "xalloc.h"
+
+#include "metrics.h"
+
+/* Maximum length of a value formatted by format_value (), including the
+   trailing NUL */
+#define VALUE_SIZE (sizeof (uintmax_t) * 3 + 10)
+
+/* Format VALUE to BUF (of VALUE_SIZE) with at most 6 fractional digits.  The
+   exposition format requires '.' as the decimal point, so don't use printf ()
+   with the %f or %g conversions, which use the locale's decimal point. */
+static void
+format_value (char *buf, double value)
+{
+  uintmax_t integer;
+  unsigned long fraction;
+  const char *sign;
+  char *p;
+
+  if (value != value)
+    {
+      strcpy (buf, "NaN");
+      return;
+    }
+  sign = "";
+  if (value < 0)
+    {
+      sign = "-";
+      value = -value;
+    }
+  if (value >= (double)UINTMAX_MAX)
+    {
+      /* Not expected for any of our metrics */
+      sprintf (buf, "%sInf", *sign != 0 ? sign : "+");
+      return;
+    }
+  integer = value;
+  fraction = (value - integer) * 1000000 + 0.5;
+  if (fraction >= 1000000)
+    {
+      integer++;
+      fraction -= 1000000;
+    }
+  p = buf + sprintf (buf, "%s%" PRIuMAX, sign, integer);
+  if (fraction != 0)
+    {
+      p += sprintf (p, ".%06lu", fraction);
+      while (p[-1] == '0')
+	p--;
+      *p = 0;
+    }
+}
+
+/* Parse a value at S, terminated by '\n' or NUL, to *VALUE.  Return 0 if OK,
+   -1 if S is not a number.  Only the form written by format_value () is
+   accepted; unlike strtod (), this does not depend on the locale. */
+static int
+parse_value (const char *s, double *value)
+{
+  double v;
+  bool negative, have_digits;
+
+  negative = *s == '-';
+  if (negative != false)
+    s++;
+  v = 0;
+  have_digits = false;
+  for (; isdigit ((unsigned char)*s); s++)
+    {
+      v = v * 10 + (*s - '0');
+      have_digits = true;
+    }
+  if (*s == '.')
+    {
+      double scale;
+
+      s++;
+      scale = 1;
+      for (; isdigit ((unsigned char)*s); s++)
+	{
+	  scale /= 10;
+	  v += (*s - '0') * scale;
+	  have_digits = true;
+	}
+    }
+  if (have_digits == false || (*s != '\n' && *s != 0))
+    return -1;
+  *value = negative != false ? -v : v;
+  return 0;
+}
+
+/* Initialize M to an empty set */
+void
+metrics_init (struct metrics *m)
+{
+  m->families = NULL;
+  m->families_len = 0;
+  m->families_size = 0;
+  m->samples = NULL;
+  m->samples_len = 0;
+  m->samples_size = 0;
+}
+
+/* Free data in M */
+void
+metrics_free (struct metrics *m)
+{
+  size_t i;
+
+  for (i = 0; i < m->samples_len; i++)
+    free (m->samples[i].key);
+  free (m->samples);
+  free (m->families);
+}
+
+/* Add a family NAME of TYPE with HELP to M, and return its index for
+   metrics_add () */
+size_t
+metrics_family (struct metrics *m, const char *name, enum metrics_type type,
+		const char *help)
+{
+  struct metrics_family *f;
+
+  if (m->families_len == m->families_size)
+    m->families = x2nrealloc (m->families, &m->families_size,
+			      sizeof (*m->families));
+  f = m->families + m->families_len;
+  f->name = name;
+  f->help = help;
+  f->type = type;
+  return m->families_len++;
+}
+
+/* Return the sample with KEY in M, or NULL */
+static struct metrics_sample *
+find_sample (const struct metrics *m, const char *key)
+{
+  size_t i;
+
+  for (i = 0; i < m->samples_len; i++)
+    {
+      if (strcmp (m->samples[i].key, key) == 0)
+	return m->samples + i;
+    }
+  return NULL;
+}
+
+/* Add VALUE to the sample of FAMILY in M with name SUFFIX appended to the
+   family name, and LABELS */
+static void
+add_sample (struct metrics *m, size_t family, const char *suffix,
+	    const char *labels, double value)
+{
+  struct metrics_sample *s;
+  const char *name;
+  char *key;
+
+  name = m->families[family].name;
+  key = xmalloc (strlen (name) + strlen (suffix) + strlen (labels) + 1);
+  sprintf (key, "%s%s%s", name, suffix, labels);
+  s = find_sample (m, key);
+  if (s != NULL)
+    {
+      free (key);
+      s->value += value;
+      return;
+    }
+  if (m->samples_len == m->samples_size)
+    m->samples = x2nrealloc (m->samples, &m->samples_size,
+			     sizeof (*m->samples));
+  s = m->samples + m->samples_len;
+  m->samples_len++;
+  s->key = key;
+  s->family = family;
+  s->value = value;
+}
+
+/* Add VALUE to the sample of FAMILY in M with LABELS (e.g. "{a=\"b\"}", or
+   ""), adding the sample if necessary */
+void
+metrics_add (struct metrics *m, size_t family, const char *labels,
+	     double value)
+{
+  add_sample (m, family, "", labels, value);
+}
+
+/* Add samples of histogram FAMILY in M with BUCKETS, recording VALUE if
+   OBSERVED */
+void
+metrics_observe (struct metrics *m, size_t family,
+		 const struct metrics_buckets *buckets, double value,
+		 bool observed)
+{
+  char labels[VALUE_SIZE + 7], bound[VALUE_SIZE];
+  size_t i;
+
+  /* Buckets are cumulative. */
+  for (i = 0; i < buckets->len; i++)
+    {
+      format_value (bound, buckets->bounds[i]);
+      sprintf (labels, "{le=\"%s\"}", bound);
+      add_sample (m, family, "_bucket", labels,
+		  observed != false && value <= buckets->bounds[i]);
+    }
+  add_sample (m, family, "_bucket", "{le=\"+Inf\"}", observed != false);
+  add_sample (m, family, "_sum", "", observed != false ? value : 0);
+  add_sample (m, family, "_count", "", observed != false);
+}
+
+/* Add values of samples in M found in F to M */
+static void
+merge_file (struct metrics *m, FILE *f)
+{
+  char *line;
+  size_t size;
+
+  line = NULL;
+  size = 0;
+  while (getline (&line, &size, f) != -1)
+    {
+      struct metrics_sample *s;
+      char *value;
+      double v;
+
+      if (line[0] == '#')
+	continue;
+      /* Our keys don't contain spaces */
+      value = strchr (line, ' ');
+      if (value == NULL)
+	continue;
+      *value = 0;
+      value++;
+      if (parse_value (value, &v) != 0)
+	continue;
+      s = find_sample (m, line);
+      if (s != NULL)
+	s->value += v;
+    }
+  free (line);
+}
+
+/* Write M to F */
+static void
+print_metrics (const struct metrics *m, FILE *f)
+{
+  static const char *const type_names[] =
+    {
+      [METRICS_COUNTER] = "counter",
+      [METRICS_GAUGE] = "gauge",
+      [METRICS_HISTOGRAM] = "histogram"
+    };
+
+  size_t i, family;
+
+  family = (size_t)-1;
+  for (i = 0; i < m->samples_len; i++)
+    {
+      const struct metrics_sample *s;
+      char value[VALUE_SIZE];
+
+      s = m->samples + i;
+      if (s->family != family)
+	{
+	  const struct metrics_family *mf;
+
+	  family = s->family;
+	  mf = m->families + family;
+	  fprintf (f, "# HELP %s %s\n# TYPE %s %s\n", mf->name, mf->help,
+		   mf->name, type_names[mf->type]);
+	}
+      format_value (value, s->value);
+      fprintf (f, "%s %s\n", s->key, value);
+    }
+}
+
+/* Open and lock FILENAME, creating it if necessary.  Return the file
+   descriptor, or -1 on error (with errno set). */
+static int
+lock_file (const char *filename)
+{
+  for (;;)
+    {
+      struct stat locked, current;
+      struct flock fl;
+      int fd;
+
+      fd = open (filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP
+		 | S_IROTH);
+      if (fd == -1)
+	return -1;
+      fl.l_type = F_WRLCK;
+      fl.l_whence = SEEK_SET;
+      fl.l_start = 0;
+      fl.l_len = 0;
+      if (fcntl (fd, F_SETLKW, &fl) != 0 || fstat (fd, &locked) != 0)
+	{
+	  int saved_errno;
+
+	  saved_errno = errno;
+	  close (fd);
+	  errno = saved_errno;
+	  return -1;
+	}
+      /* The process that held the lock may have replaced the file. */
+      if (stat (filename, &current) == 0 && current.st_dev == locked.st_dev
+	  && current.st_ino == locked.st_ino)
+	return fd;
+      close (fd);
+    }
+}
+
+/* Replace FILENAME by a file containing M.  If MERGE, add values of samples
+   of M found in the previous contents of FILENAME to M first, serializing
+   with other processes doing the same.  Return 0 if OK, -1 on error (with
+   errno set). */
+int
+metrics_write (struct metrics *m, const char *filename, bool merge)
+{
+  char *tmp;
+  FILE *f, *old;
+  int fd, saved_errno;
+
+  /* OLD holds the lock; closing any file descriptor of the file would
+     release it. */
+  old = NULL;
+  if (merge != false)
+    {
+      fd = lock_file (filename);
+      if (fd == -1)
+	return -1;
+      old = fdopen (fd, "r");
+      if (old == NULL)
+	{
+	  saved_errno = errno;
+	  close (fd);
+	  errno = saved_errno;
+	  return -1;
+	}
+      merge_file (m, old);
+    }
+  tmp = xmalloc (strlen (filename) + 8);
+  sprintf (tmp, "%s.XXXXXX", filename);
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    goto err_tmp;
+  /* Readable by the textfile collector */
+  if (fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0)
+    {
+      close (fd);
+      goto err_unlink;
+    }
+  f = fdopen (fd, "w");
+  if (f == NULL)
+    {
+      close (fd);
+      goto err_unlink;
+    }
+  print_metrics (m, f);
+  if (ferror (f) != 0 || fflush (f) != 0)
+    {
+      saved_errno = errno;
+      fclose (f);
+      errno = saved_errno;
+      goto err_unlink;
+    }
+  if (fclose (f) != 0 || rename (tmp, filename) != 0)
+    goto err_unlink;
+  free (tmp);
+  if (old != NULL)
+    fclose (old);
+  return 0;
+
+ err_unlink:
+  saved_errno = errno;
+  unlink (tmp);
+  errno = saved_errno;
+ err_tmp:
+  free (tmp);
+  if (old != NULL)
+    {
+      saved_errno = errno;
+      fclose (old);
+      errno = saved_errno;
+    }
+  return -1;
+}
+
+/* Return current time in seconds */
+double
+metrics_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
@@ -0,0 +1,97 @@
+/* Metrics in the Prometheus text exposition format.
+
+Copyright (C) 2026 Red Hat, Inc. All rights reserved.
+This copyrighted material is made available to anyone wishing to use, modify,
+copy, or redistribute it subject to the terms and conditions of the GNU General
+Public License v.2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Miloslav Trmac <mitr@redhat.com> */
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Metric types */
+enum metrics_type
+  {
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+    METRICS_HISTOGRAM
+  };
+
+/* A metric family: a name shared by one or more samples */
+struct metrics_family
+{
+  const char *name, *help;
+  enum metrics_type type;
+};
+
+/* A sample, "name{labels} value" */
+struct metrics_sample
+{
+  char *key;			/* Name including labels */
+  size_t family;		/* Index of the family in metrics.families */
+  double value;
+};
+
+/* A set of samples, in the order they are written */
+struct metrics
+{
+  struct metrics_family *families;
+  size_t families_len, families_size;
+  struct metrics_sample *samples;
+  size_t samples_len, samples_size;
+};
+
+/* Upper bounds of the buckets of a histogram, in increasing order, without
+   +Inf */
+struct metrics_buckets
+{
+  const double *bounds;
+  size_t len;
+};
+
+/* Initialize M to an empty set */
+extern void metrics_init (struct metrics *m);
+
+/* Free data in M */
+extern void metrics_free (struct metrics *m);
+
+/* Add a family NAME of TYPE with HELP to M, and return its index for
+   metrics_add () */
+extern size_t metrics_family (struct metrics *m, const char *name,
+			      enum metrics_type type, const char *help);
+
+/* Add VALUE to the sample of FAMILY in M with LABELS (e.g. "{a=\"b\"}", or
+   ""), adding the sample if necessary */
+extern void metrics_add (struct metrics *m, size_t family, const char *labels,
+			 double value);
+
+/* Add samples of histogram FAMILY in M with BUCKETS, recording VALUE if
+   OBSERVED */
+extern void metrics_observe (struct metrics *m, size_t family,
+			     const struct metrics_buckets *buckets,
+			     double value, bool observed);
+
+/* Replace FILENAME by a file containing M.  If MERGE, add values of samples
+   of M found in the previous contents of FILENAME to M first, serializing
+   with other processes doing the same.  Return 0 if OK, -1 on error (with
+   errno set). */
+extern int metrics_write (struct metrics *m, const char *filename, bool merge);
+
+/* Return current time in seconds */
+extern double metrics_now (void);
+
+#endif
@@ -0,0 +1,59 @@
+/* Static tracing probes.
+
+Copyright (C) 2026 Red Hat, Inc. All rights reserved.
+This copyrighted material is made available to anyone wishing to use, modify,
+copy, or redistribute it subject to the terms and conditions of the GNU General
+Public License v.2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51 Franklin
+Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Miloslav Trmac <mitr@redhat.com> */
+
+#ifndef PROBES_H__
+#define PROBES_H__
+
+#include <config.h>
+
+/* The probes are USDT probes of the "mlocate" provider, e.g.
+   "usdt:/usr/bin/updatedb:mlocate:dir__start" for bpftrace.  A probe site is a
+   single nop instruction when no tracer is attached; arguments should
+   therefore be values that are already at hand, not computed only for the
+   probe.
+
+   updatedb:
+   dir__start (path): scan () is starting to handle PATH
+   dir__end (path): scan () has finished handling PATH and its subdirectories
+   dir__reuse (path, entries): the old record of PATH, with ENTRIES entries,
+     was reused without reading the directory
+   mount__rebuild__start (): the mount table is being reread
+   mount__rebuild__end (changed): the mount table was reread; CHANGED is 1 if
+     the list of bind mounts was rebuilt
+
+   locate:
+   db__start (database): locate is starting to read DATABASE
+   db__end (database, matches): locate has finished reading DATABASE; MATCHES
+     is the total number of matches found so far
+   match (path): PATH matches and is being output or counted */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE0(NAME) DTRACE_PROBE (mlocate, NAME)
+#define PROBE1(NAME, A1) DTRACE_PROBE1 (mlocate, NAME, A1)
+#define PROBE2(NAME, A1, A2) DTRACE_PROBE2 (mlocate, NAME, A1, A2)
+
+#else
+
+#define PROBE0(NAME) ((void)0)
+#define PROBE1(NAME, A1) ((void)0)
+#define PROBE2(NAME, A1, A2) ((void)0)
+
+#endif
+
+#endif
@@ -23,6 +23,7 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <locale.h>
 #include <signal.h>
@@ -34,13 +35,36 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined (HAVE_STATX) && defined (HAVE_STRUCT_STATX_STX_MNT_ID)	\
+  && defined (STATX_MNT_ID) && defined (STATX_ATTR_MOUNT_ROOT)
+#include <sys/sysmacros.h>
+#define USE_STATX_MOUNT_INFO 1
+#endif
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
+#if defined (HAVE_SYS_FANOTIFY_H) && defined (HAVE_OPEN_BY_HANDLE_AT) \
+  && defined (FAN_REPORT_DIR_FID)
+#include <poll.h>
+#include <sys/statfs.h>
+#define USE_FANOTIFY 1
+#endif
+#if defined (HAVE_PTHREAD_H) && defined (HAVE_PTHREAD_CREATE) \
+  && defined (HAVE_FDOPENDIR)
+#include <pthread.h>
+#define USE_PREFETCH 1
+#endif
 
 #include <mntent.h>
 #include "error.h"
+#include "full-write.h"
 #include "fwriteerror.h"
 #include "obstack.h"
 #include "progname.h"
+#include "safe-read.h"
 #include "stat-time.h"
 #include "verify.h"
 #include "xalloc.h"
@@ -49,6 +73,8 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #include "conf.h"
 #include "db.h"
 #include "lib.h"
+#include "metrics.h"
+#include "probes.h"
 
 #ifdef PROC_MOUNTS_PATH
 #define MOUNT_TABLE_PATH PROC_MOUNTS_PATH
@@ -56,21 +82,31 @@ Author: Miloslav Trmac <mitr@redhat.com> */
 #define MOUNT_TABLE_PATH _PATH_MOUNTED
 #endif
 
-/* A directory entry in memory */
-struct entry
-{
-  size_t name_size;		/* Including the trailing NUL */
-  bool is_directory;
-  char name[];
-};
+/* Pressure stall information about I/O on Linux */
+#define PRESSURE_IO_PATH "/proc/pressure/io"
 
-/* Data for directory building */
+/* Suffix of the file describing the last checkpoint of an updatedb run */
+#define CHECKPOINT_SUFFIX ".checkpoint"
+/* Suffix of the file containing the directory at which the last updatedb run
+   ran out of conf_time_budget */
+#define POSITION_SUFFIX ".position"
+/* Suffix of the file containing the conf_stagger slot of the next updatedb
+   run */
+#define STAGGER_SUFFIX ".stagger"
+
+/* Entries of the directories being processed, as a stack.  Each entry is
+   encoded as in the database: DBE_NORMAL or DBE_DIRECTORY followed by a
+   NUL-terminated name.  Entries are referred to by offsets relative to the
+   start of data of their directory, which remain valid when data moves. */
 struct dir_state
 {
-  /* Obstack of directory paths and 'struct entry' entries */
-  struct obstack data_obstack;
-  /* Obstack of 'void *' (struct entry *) lists */
-  struct obstack list_obstack;
+  char *data;
+  size_t data_size, data_used;
+  uint32_t *offsets;		/* Entry offsets of all directories */
+  size_t offsets_size, offsets_used;
+  size_t peak_memory;		/* Peak of dir_state_memory () */
+  size_t largest_dir_memory;	/* Memory used by the largest directory */
+  char *largest_dir_path;	/* Path of that directory, for free () */
 };
 
 /* Time representation */
@@ -80,12 +116,22 @@ struct time
   uint32_t nsec;		/* 0 <= nsec < 1e9 */
 };
 
-/* A directory in memory, using storage in obstacks */
+/* Mount information about a directory */
+struct mount_info
+{
+  bool known;			/* Are the members below valid? */
+  bool is_root;			/* The directory is a root of a mount */
+  int id;			/* Mount ID, as used in MOUNTINFO_PATH */
+};
+
+/* A directory in memory, using storage in a struct dir_state */
 struct directory
 {
   struct time time;
-  void **entries;		/* Pointers to struct entry */
+  size_t data_start;		/* Start of the entries in data */
+  size_t offsets_start;		/* Start of the entry offsets in offsets */
   size_t num_entries;
+  bool spilled;			/* Some entries are stored in spill_fd */
   char *path;			/* Absolute path */
 };
 
@@ -128,13 +174,26 @@ time_compare (const struct time *a, const struct time *b)
   return 0;
 }
 
+/* Seconds added to the current time by time_is_current () */
+static time_t time_offset; /* = 0; */
+
+/* Earliest time rejected by time_is_current () as too current */
+static struct time time_current_cache; /* = { 0, } */
+
+/* Set time_offset to OFFSET */
+static void
+time_set_offset (time_t offset)
+{
+  time_offset = offset;
+  time_current_cache.sec = 0;
+  time_current_cache.nsec = 0;
+}
+
 /* Is T recent enough that the filesystem could be changed without changing the
    timestamp again? */
 static bool
 time_is_current (const struct time *t)
 {
-  static struct time cache; /* = { 0, } */
-
   struct timeval tv;
 
   /* This is more difficult than it should be because Linux uses a cheaper time
@@ -155,97 +214,520 @@ time_is_current (const struct time *t)
      recently updated _and_ is will not be updated again until the next
      updatedb run; this is not likely to happen for most directories. */
 
-  /* Cache gettimeofday () results to rule out obviously old time stamps;
-     CACHE contains the earliest time we reject as too current. */
-  if (time_compare (t, &cache) < 0)
+  /* Cache gettimeofday () results to rule out obviously old time stamps. */
+  if (time_compare (t, &time_current_cache) < 0)
     return false;
   gettimeofday (&tv, NULL);
-  cache.sec = tv.tv_sec - 3;
-  cache.nsec = tv.tv_usec * 1000;
-  return time_compare (t, &cache) >= 0;
+  time_current_cache.sec = tv.tv_sec + time_offset - 3;
+  time_current_cache.nsec = tv.tv_usec * 1000;
+  return time_compare (t, &time_current_cache) >= 0;
+}
+
+ /* Directory entry storage */
+
+/* Use insertion sort for at most this many entries */
+enum { SORT_INSERTION_MAX = 16 };
+
+/* Return byte DEPTH of the name of entry at offset OFFSET in BASE, compared
+   as unsigned char like in strcmp () */
+#define ENTRY_CHAR(BASE, OFFSET, DEPTH)					\
+  (((const unsigned char *)(BASE))[(OFFSET) + sizeof (struct db_entry)	\
+				   + (DEPTH)])
+
+/* Compare names of entries at offsets A and B in BASE, ignoring the first
+   DEPTH bytes, which are known to be equal */
+static int
+cmp_entries_from (const char *base, uint32_t a, uint32_t b, size_t depth)
+{
+  return strcmp (base + a + sizeof (struct db_entry) + depth,
+		 base + b + sizeof (struct db_entry) + depth);
+}
+
+/* Sort entries at OFFSETS in BASE with NUM entries, the first DEPTH bytes of
+   all names being equal, by insertion; give up after more than MAX_MOVES
+   moves.  Return true if the entries are sorted. */
+static bool
+insertion_sort_entries (const char *base, uint32_t *offsets, size_t num,
+			size_t depth, size_t max_moves)
+{
+  size_t i, moves;
+
+  moves = 0;
+  for (i = 1; i < num; i++)
+    {
+      uint32_t e;
+      size_t j;
+
+      e = offsets[i];
+      for (j = i;
+	   j > 0 && cmp_entries_from (base, offsets[j - 1], e, depth) > 0;
+	   j--)
+	{
+	  if (moves == max_moves)
+	    {
+	      offsets[j] = e;
+	      return false;
+	    }
+	  moves++;
+	  offsets[j] = offsets[j - 1];
+	}
+      offsets[j] = e;
+    }
+  return true;
+}
+
+/* Sort entries at OFFSETS in BASE with NUM entries, the first DEPTH bytes of
+   all names being equal, using multikey quicksort (Bentley, Sedgewick: Fast
+   Algorithms for Sorting and Searching Strings).  Only the smaller partitions
+   are handled recursively, so the recursion depth is logarithmic. */
+static void
+multikey_sort_entries (const char *base, uint32_t *offsets, size_t num,
+		       size_t depth)
+{
+  while (num > SORT_INSERTION_MAX)
+    {
+      unsigned a, b, c, pivot;
+      size_t lt, i, gt, num_lt, num_eq, num_gt;
+      uint32_t tmp;
+
+      a = ENTRY_CHAR (base, offsets[0], depth);
+      b = ENTRY_CHAR (base, offsets[num / 2], depth);
+      c = ENTRY_CHAR (base, offsets[num - 1], depth);
+      if (a > b)
+	{
+	  unsigned t;
+
+	  t = a;
+	  a = b;
+	  b = t;
+	}
+      pivot = c < a ? a : c > b ? b : c;
+      /* [0, lt) < pivot, [lt, i) == pivot, [gt, num) > pivot */
+      lt = 0;
+      i = 0;
+      gt = num;
+      while (i < gt)
+	{
+	  unsigned ch;
+
+	  ch = ENTRY_CHAR (base, offsets[i], depth);
+	  if (ch < pivot)
+	    {
+	      tmp = offsets[lt];
+	      offsets[lt] = offsets[i];
+	      offsets[i] = tmp;
+	      lt++;
+	      i++;
+	    }
+	  else if (ch > pivot)
+	    {
+	      gt--;
+	      tmp = offsets[gt];
+	      offsets[gt] = offsets[i];
+	      offsets[i] = tmp;
+	    }
+	  else
+	    i++;
+	}
+      num_lt = lt;
+      /* Names ending at DEPTH are all equal and need no sorting. */
+      num_eq = pivot != 0 ? gt - lt : 0;
+      num_gt = num - gt;
+      if (num_lt >= num_eq && num_lt >= num_gt)
+	{
+	  multikey_sort_entries (base, offsets + lt, num_eq, depth + 1);
+	  multikey_sort_entries (base, offsets + gt, num_gt, depth);
+	  num = num_lt;
+	}
+      else if (num_gt >= num_eq)
+	{
+	  multikey_sort_entries (base, offsets, num_lt, depth);
+	  multikey_sort_entries (base, offsets + lt, num_eq, depth + 1);
+	  offsets += gt;
+	  num = num_gt;
+	}
+      else
+	{
+	  multikey_sort_entries (base, offsets, num_lt, depth);
+	  multikey_sort_entries (base, offsets + gt, num_gt, depth);
+	  offsets += lt;
+	  num = num_eq;
+	  depth++;
+	}
+    }
+  insertion_sort_entries (base, offsets, num, depth, SIZE_MAX);
+}
+
+/* Sort entries at OFFSETS in BASE with NUM entries by name, in strcmp ()
+   order.  Sorted and nearly sorted input, which is returned by some
+   filesystems, is handled in linear time. */
+static void
+sort_entries (const char *base, uint32_t *offsets, size_t num)
+{
+  size_t i, descents;
+
+  descents = 0;
+  for (i = 1; i < num; i++)
+    {
+      if (cmp_entries_from (base, offsets[i - 1], offsets[i], 0) > 0)
+	descents++;
+    }
+  if (descents == 0)
+    return;
+  if (descents <= num / 32
+      && insertion_sort_entries (base, offsets, num, 0, num) != false)
+    return;
+  multikey_sort_entries (base, offsets, num, 0);
 }
 
- /* Directory obstack handling */
+#undef ENTRY_CHAR
 
 /* Prepare STATE for reading directories */
 static void
 dir_state_init (struct dir_state *state)
 {
-  obstack_init (&state->data_obstack);
-  obstack_init (&state->list_obstack);
+  memset (state, 0, sizeof (*state));
+}
+
+/* Return memory used by entries in STATE */
+static size_t
+dir_state_memory (const struct dir_state *state)
+{
+  return state->data_used + state->offsets_used * sizeof (*state->offsets);
+}
+
+/* Start building DIR on top of STATE. */
+static void
+dir_start (struct directory *dir, struct dir_state *state)
+{
+  dir->data_start = state->data_used;
+  dir->offsets_start = state->offsets_used;
+  dir->num_entries = 0;
+  dir->spilled = false;
+}
+
+/* Return entry I of DIR in STATE.  The result is invalidated by adding
+   entries to STATE. */
+static char *
+dir_entry (const struct dir_state *state, const struct directory *dir,
+	   size_t i)
+{
+  return (state->data + dir->data_start
+	  + state->offsets[dir->offsets_start + i]);
+}
+
+/* Add an entry with TYPE and NAME with NAME_SIZE (including the trailing NUL)
+   to DIR, which is on top of STATE, respecting conf_max_memory if LIMITED.
+   Return 0 if OK, -1 if DIR does not fit into STATE. */
+static int
+dir_add_entry (struct directory *dir, struct dir_state *state, uint8_t type,
+	       const char *name, size_t name_size, bool limited)
+{
+  size_t offset, size;
+  char *p;
+
+  offset = state->data_used - dir->data_start;
+  size = sizeof (struct db_entry) + name_size;
+  if (offset > UINT32_MAX)
+    return -1;
+  if (limited != false && conf_max_memory != 0
+      && (dir_state_memory (state) + size + sizeof (*state->offsets)
+	  > conf_max_memory))
+    return -1;
+  while (size > state->data_size - state->data_used)
+    state->data = x2realloc (state->data, &state->data_size);
+  p = state->data + state->data_used;
+  *p = type;
+  memcpy (p + sizeof (struct db_entry), name, name_size);
+  state->data_used += size;
+  if (state->offsets_used == state->offsets_size)
+    state->offsets = x2nrealloc (state->offsets, &state->offsets_size,
+				 sizeof (*state->offsets));
+  state->offsets[state->offsets_used] = offset;
+  state->offsets_used++;
+  dir->num_entries++;
+  if (dir_state_memory (state) > state->peak_memory)
+    state->peak_memory = dir_state_memory (state);
+  return 0;
+}
+
+/* Finish building DIR on top of STATE, sorting its entries if SORT. */
+static void
+dir_finish (struct directory *dir, struct dir_state *state, bool sort)
+{
+  size_t size;
+
+  if (sort != false)
+    sort_entries (state->data + dir->data_start,
+		  state->offsets + dir->offsets_start, dir->num_entries);
+  size = dir_state_memory (state) - (dir->data_start + dir->offsets_start
+				     * sizeof (*state->offsets));
+  if (size > state->largest_dir_memory)
+    {
+      state->largest_dir_memory = size;
+      free (state->largest_dir_path);
+      state->largest_dir_path = xstrdup (dir->path);
+    }
+}
+
+/* Drop entries of DIR, which is on top of STATE, that are not directories,
+   to free memory while its subdirectories are being scanned. */
+static void
+dir_keep_subdirs (struct directory *dir, struct dir_state *state)
+{
+  size_t src, dest, num;
+
+  src = dir->data_start;
+  dest = dir->data_start;
+  num = 0;
+  /* Entries are stored in the order they were added, not in the sorted
+     order; so they are compacted in the storage order and sorted again. */
+  while (src < state->data_used)
+    {
+      char *e;
+      size_t size;
+
+      e = state->data + src;
+      size = (sizeof (struct db_entry)
+	      + strlen (e + sizeof (struct db_entry)) + 1);
+      if (*e == DBE_DIRECTORY)
+	{
+	  memmove (state->data + dest, e, size);
+	  state->offsets[dir->offsets_start + num] = dest - dir->data_start;
+	  num++;
+	  dest += size;
+	}
+      src += size;
+    }
+  state->data_used = dest;
+  state->offsets_used = dir->offsets_start + num;
+  dir->num_entries = num;
+  sort_entries (state->data + dir->data_start,
+		state->offsets + dir->offsets_start, num);
+}
+
+/* Free DIR, which is on top of STATE, and all data added after it. */
+static void
+dir_free (struct directory *dir, struct dir_state *state)
+{
+  state->data_used = dir->data_start;
+  state->offsets_used = dir->offsets_start;
+}
+
+ /* Mount information */
+
+#ifdef USE_STATX_MOUNT_INFO
+/* Convert relevant parts of STX to ST */
+static void
+stat_from_statx (struct stat *st, const struct statx *stx)
+{
+  memset (st, 0, sizeof (*st));
+  st->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_size = stx->stx_size;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+#endif
+
+/* true if the last lstat_mount_info () call provided mount information, or
+   if it is expected to before the first call */
+#ifdef USE_STATX_MOUNT_INFO
+static bool mount_info_available = true;
+#else
+static bool mount_info_available; /* = false; */
+#endif
+
+/* lstat () RELATIVE to ST, and store its mount information to MI.
+   Return 0 if OK, -1 on error. */
+static int
+lstat_mount_info (const char *relative, struct stat *st, struct mount_info *mi)
+{
+#ifdef USE_STATX_MOUNT_INFO
+  static bool statx_failed; /* = false; */
+
+  if (statx_failed == false)
+    {
+      struct statx stx;
+
+      /* The mount information comes from the same call, so bind mounts can be
+	 recognized without comparing any paths. */
+      if (statx (AT_FDCWD, relative, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+		 STATX_BASIC_STATS | STATX_MNT_ID, &stx) == 0)
+	{
+	  stat_from_statx (st, &stx);
+	  mi->known = ((stx.stx_mask & STATX_MNT_ID) != 0
+		       && (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) != 0
+		       && stx.stx_mnt_id <= INT_MAX);
+	  mi->is_root = (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT) != 0;
+	  mi->id = stx.stx_mnt_id;
+	  mount_info_available = mi->known;
+	  return 0;
+	}
+      if (errno != ENOSYS)
+	return -1;
+      statx_failed = true;
+    }
+#endif
+  mi->known = false;
+  mi->is_root = false;
+  mi->id = 0;
+  mount_info_available = false;
+  return lstat (relative, st);
+}
+
+/* Return true if PATH with mount information MI is a destination of a bind
+   mount */
+static bool
+dir_is_bind_mount (const char *path, const struct mount_info *mi)
+{
+  if (mi->known == false)
+    return is_bind_mount (path);
+  if (mi->is_root == false)
+    return false;
+  return is_bind_mount_id (mi->id);
 }
 
-/* Finish building a directory in STATE, store its data to DIR. */
+ /* Change log */
+
+/* The change log being written, or NULL */
+static FILE *changelog_file; /* = NULL; */
+
+/* Write a change log record of TYPE for entry NAME in directory DIR */
 static void
-dir_finish (struct directory *dir, struct dir_state *state)
+changelog_write (char type, const char *dir, const char *name)
 {
-  dir->num_entries
-    = OBSTACK_OBJECT_SIZE (&state->list_obstack) / sizeof (*dir->entries);
-  dir->entries = obstack_finish (&state->list_obstack);
+  putc (type, changelog_file);
+  fputs (dir, changelog_file);
+  if (dir[0] != '/' || dir[1] != 0)
+    putc ('/', changelog_file);
+  fputs (name, changelog_file);
+  putc (0, changelog_file);
 }
 
  /* Reading of the existing database */
 
-/* The old database or old_db_is_closed.  old_db.fd == -1 if the database was
-   never opened. */
-static struct db old_db;
-/* Header for unread directory from the old database or old_dir.path == NULL */
+/* An old database */
+struct old_source
+{
+  struct db db;			/* db.fd == -1 if not opened */
+  /* Obstack for dir.path, old_dir_skip () and copy_old_dir () */
+  struct obstack obstack;
+  /* Header for unread directory or dir.path == NULL */
+  struct directory dir;
+  bool removed;			/* dir marks a removed directory */
+};
+
+/* The old database and its delta, valid unless old_db_is_closed.
+   old_delta.db.fd == -1 if there is no valid delta. */
+static struct old_source old_base, old_delta;
+/* The database written by an interrupted updatedb up to its last checkpoint,
+   valid unless old_db_is_closed; old_partial.db.fd == -1 if there is none.
+   old_base.dir.path may be NULL even if old_db_is_closed == false if only
+   old_partial is valid. */
+static struct old_source old_partial;
+/* File name of old_partial if it was not yet removed, or NULL */
+static char *old_partial_filename; /* = NULL; */
+/* Sources of old_dir, in order of precedence */
+static struct old_source *const old_sources[] =
+  {
+    &old_partial, &old_delta, &old_base
+  };
+/* Header for unread directory from old_base and old_delta merged, or
+   old_dir.path == NULL.  Refers to data in old_dir_source. */
 static struct directory old_dir; /* = { 0, }; */
-/* true if old_db should not be accessed any more.  (old_db.fd cannot be closed
-   immediatelly because that would release the lock on the database). */
+/* The database containing old_dir */
+static struct old_source *old_dir_source;
+/* true if old_base and old_delta should not be accessed any more.
+   (old_base.db.fd cannot be closed immediatelly because that would release
+   the lock on the database). */
 static bool old_db_is_closed; /* = 0; */
+/* Configuration block of old_base, valid unless old_db_is_closed */
+static char *old_conf_block; /* = NULL; */
+static size_t old_conf_block_size; /* = 0; */
+/* true if old_base was written with different pruning configuration */
+static bool old_db_pruning_changed; /* = false; */
 
-/* Obstack for old_dir.path and old_dir_skip () */
-static struct obstack old_dir_obstack;
+/* true if the new database is a delta relative to old_base */
+static bool new_db_is_delta; /* = false; */
+/* Path of the last directory record written to the new delta, or NULL */
+static char *delta_last_path; /* = NULL; */
+/* Paths of old_base records read after delta_last_path, for which it is not
+   yet known whether they will be written to the new delta */
+static struct string_list delta_pending; /* = { 0, }; */
 
-/* Close old_db */
+/* Forward declaration */
+static void delta_base_record_done (const char *path);
+
+/* Close old_base and old_delta */
 static void
 old_db_close (void)
 {
   old_dir.path = NULL;
   old_db_is_closed = true;
-  /* The file will really be closed at the end of main (). */
+  /* The file will really be closed at the end of update_database (). */
 }
 
-/* Read next directory header, if any, to old_dir */
+/* Read next directory header, if any, from SRC */
 static void
-old_dir_next_header (void)
+old_source_next_header (struct old_source *src)
 {
   struct db_directory dir;
+  off_t offset;
+  uint32_t nsec;
 
-  if (old_db_is_closed)
-    return;
-  if (old_dir.path != NULL)
-    obstack_free (&old_dir_obstack, old_dir.path);
-  if (db_read (&old_db, &dir, sizeof (dir)) != 0)
-    goto err;
-  old_dir.time.sec = ntohll (dir.time_sec);
-  old_dir.time.nsec = ntohl (dir.time_nsec);
-  if (old_dir.time.nsec >= 1000000000)
+  if (src->dir.path != NULL)
+    {
+      if (src == &old_base && new_db_is_delta != false)
+	delta_base_record_done (src->dir.path);
+      obstack_free (&src->obstack, src->dir.path);
+      src->dir.path = NULL;
+    }
+  offset = db_bytes_read (&src->db);
+  if (db_read (&src->db, &dir, sizeof (dir)) != 0)
+    {
+      /* A truncated header is an error, not EOF. */
+      if (src->db.err != 0 || db_bytes_read (&src->db) != offset)
+	old_db_close ();
+      return;
+    }
+  src->dir.time.sec = ntohll (dir.time_sec);
+  nsec = ntohl (dir.time_nsec);
+  src->removed = src == &old_delta && nsec == DB_NSEC_REMOVED;
+  if (src->removed != false)
+    nsec = 0;
+  else if (nsec >= 1000000000)
     goto err;
-  if (db_read_name (&old_db, &old_dir_obstack) != 0)
+  src->dir.time.nsec = nsec;
+  if (db_read_name (&src->db, &src->obstack) != 0)
     goto err;
-  obstack_1grow (&old_dir_obstack, 0);
-  old_dir.path = obstack_finish (&old_dir_obstack);
+  obstack_1grow (&src->obstack, 0);
+  src->dir.path = obstack_finish (&src->obstack);
   return;
 
  err:
   old_db_close ();
 }
 
-/* Skip next directory in old_db */
+/* Skip next directory in SRC, log its entries as removed if LOG_REMOVED */
 static void
-old_dir_skip (void)
+old_source_skip (struct old_source *src, bool log_removed)
 {
   void *mark;
 
-  mark = obstack_alloc (&old_dir_obstack, 0);
+  mark = obstack_alloc (&src->obstack, 0);
   for (;;)
     {
       struct db_entry entry;
       void *p;
 
-      if (db_read (&old_db, &entry, sizeof (entry)) != 0)
+      if (db_read (&src->db, &entry, sizeof (entry)) != 0)
 	goto err;
       switch (entry.type)
 	{
@@ -258,56 +740,206 @@ old_dir_skip (void)
 	default:
 	  goto err;
 	}
-      if (db_read_name (&old_db, &old_dir_obstack) != 0)
+      if (db_read_name (&src->db, &src->obstack) != 0)
 	goto err;
-      p = obstack_finish (&old_dir_obstack);
-      obstack_free (&old_dir_obstack, p);
+      obstack_1grow (&src->obstack, 0);
+      p = obstack_finish (&src->obstack);
+      if (log_removed != false && changelog_file != NULL)
+	changelog_write ('-', src->dir.path, p);
+      obstack_free (&src->obstack, p);
     }
  done:
   return;
 
  err:
-  (void)obstack_finish (&old_dir_obstack);
-  obstack_free (&old_dir_obstack, mark);
+  (void)obstack_finish (&src->obstack);
+  obstack_free (&src->obstack, mark);
   old_db_close ();
 }
 
-/* Open the old database and prepare for reading it.  Return a file descriptor
-   for the database (even if its contents are not valid), -1 on error opening
-   the file. */
-static int
-old_db_open (void)
+/* Set old_dir to the first unread directory in old_sources */
+static void
+old_dir_select (void)
 {
-  struct obstack obstack;
-  int fd;
-  struct db_header hdr;
-  const char *src;
-  uint32_t size;
+  for (;;)
+    {
+      struct old_source *src;
+      size_t i;
 
-  /* Use O_RDWR, not O_RDONLY, to be able to lock the file. */
-  fd = open (conf_output, O_RDWR);
-  if (fd == -1)
+      if (old_db_is_closed)
+	return;
+      src = NULL;
+      for (i = 0; i < ARRAY_SIZE (old_sources); i++)
+	{
+	  if (old_sources[i]->dir.path != NULL
+	      && (src == NULL
+		  || dir_path_cmp (old_sources[i]->dir.path, src->dir.path)
+		  < 0))
+	    src = old_sources[i];
+	}
+      if (src == NULL)
+	{
+	  old_dir.path = NULL;
+	  return;
+	}
+      for (i = 0; i < ARRAY_SIZE (old_sources); i++)
+	{
+	  struct old_source *other;
+
+	  other = old_sources[i];
+	  if (other != src && other->dir.path != NULL
+	      && strcmp (other->dir.path, src->dir.path) == 0)
+	    {
+	      /* Replaced by SRC */
+	      old_source_skip (other, false);
+	      old_source_next_header (other);
+	      if (old_db_is_closed)
+		return;
+	    }
+	}
+      if (src->removed == false)
+	{
+	  old_dir = src->dir;
+	  old_dir_source = src;
+	  return;
+	}
+      old_source_skip (src, false);
+      old_source_next_header (src);
+    }
+}
+
+/* Read next directory header, if any, to old_dir */
+static void
+old_dir_next_header (void)
+{
+  if (old_db_is_closed || old_dir.path == NULL)
+    return;
+  old_source_next_header (old_dir_source);
+  old_dir_select ();
+}
+
+/* Skip the directory at old_dir, which is not present any more */
+static void
+old_dir_skip (void)
+{
+  if (old_db_is_closed || old_dir.path == NULL)
+    return;
+  old_source_skip (old_dir_source, true);
+}
+
+/* Skip all remaining directories in the old database */
+static void
+old_dir_skip_rest (void)
+{
+  while (old_dir.path != NULL)
     {
-      old_db.fd = -1;
-      goto err;
+      old_dir_skip ();
+      old_dir_next_header ();
+    }
+}
+
+/* true if entries of old_dir are being compared with a new record of the same
+   directory */
+static bool changelog_old_active; /* = false; */
+/* Next unread entry of old_dir if changelog_old_active, or NULL at the end of
+   the directory */
+static char *changelog_old_name; /* = NULL; */
+
+/* Read next entry of old_dir to changelog_old_name */
+static void
+changelog_old_next (void)
+{
+  struct old_source *src;
+  struct db_entry entry;
+  void *p;
+
+  src = old_dir_source;
+  if (changelog_old_name != NULL)
+    {
+      obstack_free (&src->obstack, changelog_old_name);
+      changelog_old_name = NULL;
     }
-  if (db_open (&old_db, &hdr, fd, conf_output, true) != 0)
+  if (db_read (&src->db, &entry, sizeof (entry)) != 0)
+    goto err;
+  switch (entry.type)
     {
-      old_db.fd = -1;
+    case DBE_NORMAL: case DBE_DIRECTORY:
+      break;
+
+    case DBE_END:
+      return;
+
+    default:
       goto err;
     }
-  size = ntohl (hdr.conf_size);
-  if (size != conf_block_size)
-    goto err_old_db;
-  obstack_init (&obstack);
-  obstack_alignment_mask (&obstack) = 0;
-  if (db_read_name (&old_db, &obstack) != 0)
-    goto err_obstack;
-  obstack_1grow (&obstack, 0);
-  if (strcmp (obstack_finish (&obstack), conf_scan_root) != 0)
+  if (db_read_name (&src->db, &src->obstack) != 0)
     goto err_obstack;
-  obstack_free (&obstack, NULL);
-  src = conf_block;
+  obstack_1grow (&src->obstack, 0);
+  changelog_old_name = obstack_finish (&src->obstack);
+  return;
+
+ err_obstack:
+  p = obstack_finish (&src->obstack);
+  obstack_free (&src->obstack, p);
+ err:
+  changelog_old_active = false;
+  old_db_close ();
+}
+
+/* Start logging changes of directory PATH, which is being written to the new
+   database */
+static void
+changelog_dir_start (const char *path)
+{
+  changelog_old_active = (old_db_is_closed == false && old_dir.path != NULL
+			  && strcmp (old_dir.path, path) == 0);
+  if (changelog_old_active != false)
+    changelog_old_next ();
+}
+
+/* Log changes up to entry NAME of directory PATH; NAME must be larger than
+   names of entries in previous calls since changelog_dir_start (), in
+   strcmp () order. */
+static void
+changelog_entry (const char *path, const char *name)
+{
+  int cmp;
+
+  cmp = 1;
+  while (changelog_old_active != false && changelog_old_name != NULL
+	 && (cmp = strcmp (changelog_old_name, name)) < 0)
+    {
+      changelog_write ('-', path, changelog_old_name);
+      changelog_old_next ();
+    }
+  if (changelog_old_active != false && changelog_old_name != NULL
+      && cmp == 0)
+    changelog_old_next ();
+  else
+    changelog_write ('+', path, name);
+}
+
+/* Finish logging changes of directory PATH */
+static void
+changelog_dir_end (const char *path)
+{
+  while (changelog_old_active != false && changelog_old_name != NULL)
+    {
+      changelog_write ('-', path, changelog_old_name);
+      changelog_old_next ();
+    }
+  if (changelog_old_active != false)
+    {
+      changelog_old_active = false;
+      old_dir_next_header ();
+    }
+}
+
+/* Read SIZE bytes from SRC and compare them with DATA.  Return 0 if they
+   match, -1 otherwise. */
+static int
+old_source_compare (struct old_source *src, const char *data, size_t size)
+{
   while (size != 0)
     {
       char buf[BUFSIZ];
@@ -316,47 +948,502 @@ old_db_open (void)
       run = sizeof (buf);
       if (run > size)
 	run = size;
-      if (db_read (&old_db, buf, run) != 0)
-	goto err_old_db;
-      if (memcmp (src, buf, run) != 0)
-	goto err_old_db;
-      src += run;
+      if (db_read (&src->db, buf, run) != 0)
+	return -1;
+      if (memcmp (data, buf, run) != 0)
+	return -1;
+      data += run;
       size -= run;
     }
-  obstack_init (&old_dir_obstack);
-  obstack_alignment_mask (&old_dir_obstack) = 0;
-  old_dir_next_header ();
-  return fd;
-
- err_obstack:
-  obstack_free (&obstack, NULL);
- err_old_db:
-  old_db_close ();
- err:
-  old_db_is_closed = true;
-  return fd;
+  return 0;
 }
 
- /* $PRUNEFS handling */
-
+/* Read the root path of SRC and compare it with the current one.
+   Return 0 if they match, -1 otherwise. */
 static int
-cmp_string_pointer (const void *xa, const void *xb)
+old_source_check_root (struct old_source *src)
 {
-  const char *a;
-  char *const *b;
+  char *root;
+  int res;
 
-  a = xa;
-  b = xb;
-  return strcmp (a, *b);
+  if (db_read_name (&src->db, &src->obstack) != 0)
+    return -1;
+  obstack_1grow (&src->obstack, 0);
+  root = obstack_finish (&src->obstack);
+  res = strcmp (root, conf_scan_root);
+  obstack_free (&src->obstack, root);
+  return res != 0 ? -1 : 0;
 }
 
-/* Return true if PATH is a mount point of an excluded filesystem */
+/* Read the root path and configuration block of SRC with HDR and compare them
+   with the current root and PREFIX with PREFIX_SIZE followed by BLOCK with
+   BLOCK_SIZE.  Return 0 if they match, -1 otherwise. */
+static int
+old_source_check_conf (struct old_source *src, const struct db_header *hdr,
+		       const char *prefix, size_t prefix_size,
+		       const char *block, size_t block_size)
+{
+  if (ntohl (hdr->conf_size) != prefix_size + block_size)
+    return -1;
+  if (old_source_check_root (src) != 0
+      || old_source_compare (src, prefix, prefix_size) != 0
+      || old_source_compare (src, block, block_size) != 0)
+    return -1;
+  return 0;
+}
+
+/* Read the configuration block of old_base with SIZE to old_conf_block.
+   Return 0 if OK, -1 on error. */
+static int
+old_conf_block_read (size_t size)
+{
+  size_t allocated;
+
+  allocated = 0;
+  while (old_conf_block_size < size)
+    {
+      size_t run;
+
+      /* Don't trust SIZE before the data is actually present. */
+      run = size - old_conf_block_size;
+      if (run > BUFSIZ)
+	run = BUFSIZ;
+      while (run > allocated - old_conf_block_size)
+	old_conf_block = x2realloc (old_conf_block, &allocated);
+      if (db_read (&old_base.db, old_conf_block + old_conf_block_size, run)
+	  != 0)
+	return -1;
+      old_conf_block_size += run;
+    }
+  return 0;
+}
+
+/* Variables in configuration blocks that only affect pruning */
+static const char *const pruning_vars[] =
+  {
+    "prune_bind_mounts", "prunefs", "prunenames", "prunepaths"
+  };
+
+/* Parse a variable at *P in a configuration block ending at END.  Store its
+   name to *NAME and its values, including the terminating empty string, to
+   *VALUES and *VALUES_SIZE, and advance *P.  Return 0 if OK, -1 if the block
+   is invalid. */
+static int
+conf_block_next_var (const char **p, const char *end, const char **name,
+		     const char **values, size_t *values_size)
+{
+  const char *q;
+
+  q = memchr (*p, 0, end - *p);
+  if (q == NULL || q == *p)
+    return -1;
+  *name = *p;
+  *values = q + 1;
+  for (;;)
+    {
+      const char *value;
+
+      value = q + 1;
+      q = memchr (value, 0, end - value);
+      if (q == NULL)
+	return -1;
+      if (q == value)
+	break;
+    }
+  *values_size = q + 1 - *values;
+  *p = q + 1;
+  return 0;
+}
+
+/* Find values of variable NAME in configuration block BLOCK with SIZE, store
+   them to *VALUES and *VALUES_SIZE.  Return 0 if found, -1 if not found or
+   the block is invalid. */
+static int
+conf_block_find_var (const char *block, size_t size, const char *name,
+		     const char **values, size_t *values_size)
+{
+  const char *p, *end;
+
+  p = block;
+  end = block + size;
+  while (p < end)
+    {
+      const char *var;
+
+      if (conf_block_next_var (&p, end, &var, values, values_size) != 0)
+	return -1;
+      if (strcmp (var, name) == 0)
+	return 0;
+    }
+  return -1;
+}
+
+/* Compare old_conf_block with conf_block, setting old_db_pruning_changed if
+   they differ only in pruning configuration.  Return 0 if old_base can be
+   used, -1 otherwise. */
+static int
+old_conf_block_compare (void)
+{
+  const char *p, *end;
+  size_t num_old_vars, num_new_vars;
+
+  old_db_pruning_changed = false;
+  if (old_conf_block_size == conf_block_size
+      && memcmp (old_conf_block, conf_block, conf_block_size) == 0)
+    return 0;
+  p = old_conf_block;
+  end = old_conf_block + old_conf_block_size;
+  num_old_vars = 0;
+  while (p < end)
+    {
+      const char *name, *old_values, *new_values;
+      size_t old_size, new_size, i;
+
+      if (conf_block_next_var (&p, end, &name, &old_values, &old_size) != 0
+	  || conf_block_find_var (conf_block, conf_block_size, name,
+				  &new_values, &new_size) != 0)
+	return -1;
+      num_old_vars++;
+      if (old_size == new_size && memcmp (old_values, new_values, old_size)
+	  == 0)
+	continue;
+      for (i = 0; i < ARRAY_SIZE (pruning_vars); i++)
+	{
+	  if (strcmp (name, pruning_vars[i]) == 0)
+	    break;
+	}
+      if (i == ARRAY_SIZE (pruning_vars))
+	return -1;
+      old_db_pruning_changed = true;
+    }
+  p = conf_block;
+  end = conf_block + conf_block_size;
+  num_new_vars = 0;
+  while (p < end)
+    {
+      const char *name, *values;
+      size_t size;
+
+      if (conf_block_next_var (&p, end, &name, &values, &size) != 0)
+	return -1;
+      num_new_vars++;
+    }
+  if (num_new_vars != num_old_vars)
+    return -1;
+  if (old_db_pruning_changed != false && conf_debug_pruning != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "Pruning configuration changed, checking all "
+	     "directories\n");
+  return 0;
+}
+
+/* Store the configuration block prefix of a delta relative to a database
+   with ST to *PREFIX (for free ()) and its size to *SIZE. */
+static void
+delta_conf_prefix (char **prefix, size_t *size, const struct stat *st)
+{
+  char id[DB_DELTA_BASE_ID_SIZE];
+  size_t len;
+
+  db_delta_base_id (id, st);
+  len = strlen (id);
+  *size = sizeof (DB_DELTA_BASE_VAR) + len + 2;
+  *prefix = xmalloc (*size);
+  memcpy (*prefix, DB_DELTA_BASE_VAR, sizeof (DB_DELTA_BASE_VAR));
+  memcpy (*prefix + sizeof (DB_DELTA_BASE_VAR), id, len + 1);
+  (*prefix)[*size - 1] = 0;
+}
+
+/* Open the delta of old_base, if any.  The delta is ignored if it is not
+   valid. */
+static void
+old_delta_open (void)
+{
+  struct db_header hdr;
+  struct stat st;
+  char *prefix, *filename;
+  size_t prefix_size;
+  int fd;
+
+  filename = xmalloc (strlen (conf_output) + sizeof (DB_DELTA_SUFFIX));
+  sprintf (filename, "%s" DB_DELTA_SUFFIX, conf_output);
+  fd = open (filename, O_RDONLY);
+  free (filename);
+  if (fd == -1)
+    return;
+  /* old_delta.db.filename is not used because the database is quiet. */
+  if (db_open (&old_delta.db, &hdr, fd, conf_output, true) != 0)
+    goto err;
+  if (fstat (old_base.db.fd, &st) != 0)
+    goto err;
+  delta_conf_prefix (&prefix, &prefix_size, &st);
+  if (old_source_check_conf (&old_delta, &hdr, prefix, prefix_size,
+			     old_conf_block, old_conf_block_size) != 0)
+    {
+      free (prefix);
+      goto err;
+    }
+  free (prefix);
+  old_source_next_header (&old_delta);
+  if (old_db_is_closed == false)
+    return;
+  /* Read old_base at least. */
+  old_db_is_closed = false;
+ err:
+  db_close (&old_delta.db);
+  old_delta.db.fd = -1;
+  old_delta.dir.path = NULL;
+}
+
+/* Lock the database opened as FD using CMD (F_SETLK or F_SETLKW).
+   Return 0 if OK, -1 on error. */
+static int
+lock_database (int fd, int cmd)
+{
+  struct flock lk;
+
+  lk.l_type = F_WRLCK;
+  lk.l_whence = SEEK_SET;
+  lk.l_start = 0;
+  lk.l_len = 0;
+  return fcntl (fd, cmd, &lk);
+}
+
+/* Return the name of the file describing the last checkpoint */
+static const char *
+checkpoint_filename (void)
+{
+  static char *filename; /* = NULL; */
+
+  if (filename == NULL)
+    {
+      filename = xmalloc (strlen (conf_output) + sizeof (CHECKPOINT_SUFFIX));
+      sprintf (filename, "%s" CHECKPOINT_SUFFIX, conf_output);
+    }
+  return filename;
+}
+
+/* Read the last checkpoint, if any, store the size of the checkpointed data
+   to *OFFSET and the name of the database containing it to *FILENAME (for
+   free ()).  Return 0 if OK, -1 if there is no valid checkpoint. */
+static int
+checkpoint_read (off_t *offset, char **filename)
+{
+  char *buf, *end, *name;
+  size_t size, name_len, output_len;
+  uintmax_t value;
+  int fd;
+
+  fd = open (checkpoint_filename (), O_RDONLY);
+  if (fd == -1)
+    return -1;
+  /* "OFFSET\0FILENAME\0", FILENAME is CONF_OUTPUT.XXXXXX */
+  output_len = strlen (conf_output);
+  buf = xmalloc (output_len + 64);
+  size = safe_read (fd, buf, output_len + 64);
+  close (fd);
+  if (size == SAFE_READ_ERROR || size == 0 || buf[size - 1] != 0
+      || !isdigit ((unsigned char)*buf))
+    goto err;
+  errno = 0;
+  value = strtoumax (buf, &end, 10);
+  if (*end != 0 || errno != 0 || (off_t)value < 0 || (uintmax_t)(off_t)value
+      != value)
+    goto err;
+  name = end + 1;
+  name_len = strlen (name);
+  if (name + name_len + 1 != buf + size || name_len != output_len + 7
+      || memcmp (name, conf_output, output_len) != 0
+      || name[output_len] != '.'
+      || strchr (name + output_len, '/') != NULL)
+    goto err;
+  *offset = value;
+  *filename = xstrdup (name);
+  free (buf);
+  return 0;
+
+ err:
+  free (buf);
+  return -1;
+}
+
+/* Open the database written by an interrupted updatedb, if any, as
+   old_partial, and remove it and its checkpoint if they are not usable. */
+static void
+old_partial_open (void)
+{
+  struct db_header hdr;
+  struct stat st;
+  char *filename;
+  off_t offset;
+  bool was_closed;
+  int fd;
+
+  old_partial.db.fd = -1;
+  old_partial.dir.path = NULL;
+  if (checkpoint_read (&offset, &filename) != 0)
+    {
+      if (access (checkpoint_filename (), F_OK) == 0)
+	unlink (checkpoint_filename ());
+      return;
+    }
+  fd = open (filename, O_RDWR);
+  if (fd == -1)
+    goto err_checkpoint;
+  /* The updatedb that wrote the checkpoint might still be running. */
+  if (lock_database (fd, F_SETLK) != 0)
+    {
+      close (fd);
+      free (filename);
+      return;
+    }
+  /* The data after the checkpoint may be incomplete. */
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size < offset
+      || ftruncate (fd, offset) != 0)
+    {
+      close (fd);
+      goto err_filename;
+    }
+  if (db_open (&old_partial.db, &hdr, fd, conf_output, true) != 0)
+    goto err_db;
+  was_closed = old_db_is_closed;
+  old_db_is_closed = false;
+  if (old_source_check_conf (&old_partial, &hdr, NULL, 0, conf_block,
+			     conf_block_size) != 0)
+    goto err_closed;
+  old_source_next_header (&old_partial);
+  if (old_db_is_closed == false)
+    {
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Resuming from checkpoint in `%s'\n", filename);
+      old_partial_filename = filename;
+      return;
+    }
+ err_closed:
+  old_db_is_closed = was_closed;
+ err_db:
+  db_close (&old_partial.db);
+  old_partial.db.fd = -1;
+  old_partial.dir.path = NULL;
+ err_filename:
+  unlink (filename);
+ err_checkpoint:
+  free (filename);
+  unlink (checkpoint_filename ());
+}
+
+/* Open the old database and prepare for reading it.  Return a file descriptor
+   for the database (even if its contents are not valid), -1 on error opening
+   the file. */
+static int
+old_db_open (void)
+{
+  int fd;
+  struct db_header hdr;
+
+  old_db_is_closed = false;
+  old_db_pruning_changed = false;
+  old_partial_filename = NULL;
+  old_conf_block_size = 0;
+  old_dir.path = NULL;
+  old_base.dir.path = NULL;
+  old_delta.dir.path = NULL;
+  old_delta.db.fd = -1;
+  obstack_init (&old_base.obstack);
+  obstack_alignment_mask (&old_base.obstack) = 0;
+  obstack_init (&old_delta.obstack);
+  obstack_alignment_mask (&old_delta.obstack) = 0;
+  obstack_init (&old_partial.obstack);
+  obstack_alignment_mask (&old_partial.obstack) = 0;
+  /* Use O_RDWR, not O_RDONLY, to be able to lock the file. */
+  fd = open (conf_output, O_RDWR);
+  if (fd == -1)
+    {
+      old_base.db.fd = -1;
+      goto err;
+    }
+  if (db_open (&old_base.db, &hdr, fd, conf_output, true) != 0)
+    {
+      old_base.db.fd = -1;
+      goto err;
+    }
+  if (old_source_check_root (&old_base) != 0
+      || old_conf_block_read (ntohl (hdr.conf_size)) != 0
+      || old_conf_block_compare () != 0)
+    goto err_old_db;
+  old_source_next_header (&old_base);
+  if (old_db_is_closed)
+    goto err;
+  old_delta_open ();
+  old_partial_open ();
+  old_dir_select ();
+  return fd;
+
+ err_old_db:
+  old_db_close ();
+ err:
+  old_db_is_closed = true;
+  old_base.dir.path = NULL;
+  old_partial_open ();
+  if (old_partial.db.fd != -1)
+    old_dir_select ();
+  return fd;
+}
+
+/* Close old_base and old_delta and free their data */
+static void
+old_db_free (void)
+{
+  if (old_delta.db.fd != -1)
+    db_close (&old_delta.db);
+  if (old_partial.db.fd != -1)
+    db_close (&old_partial.db);
+  free (old_partial_filename);
+  obstack_free (&old_base.obstack, NULL);
+  obstack_free (&old_delta.obstack, NULL);
+  obstack_free (&old_partial.obstack, NULL);
+  free (old_conf_block);
+  old_conf_block = NULL;
+}
+
+ /* $PRUNEFS handling */
+
+static int
+cmp_string_pointer (const void *xa, const void *xb)
+{
+  const char *a;
+  char *const *b;
+
+  a = xa;
+  b = xb;
+  return strcmp (a, *b);
+}
+
+/* Return true if filesystem type TYPE is in conf_prunefs */
 static bool
-filesystem_is_excluded (const char *path)
+filesystem_type_is_excluded (const char *fs_type)
 {
   static char *type; /* = NULL; */
   static size_t type_size; /* = 0; */
 
+  char *p;
+  size_t size;
+
+  size = strlen (fs_type) + 1;
+  while (size > type_size)
+    type = x2realloc (type, &type_size);
+  memcpy (type, fs_type, size);
+  for (p = type; *p != 0; p++)
+    *p = toupper((unsigned char)*p);
+  return bsearch (type, conf_prunefs.entries, conf_prunefs.len,
+		  sizeof (*conf_prunefs.entries), cmp_string_pointer) != NULL;
+}
+
+/* Return true if PATH is a mount point of an excluded filesystem */
+static bool
+filesystem_is_excluded (const char *path)
+{
   FILE *f;
   struct mntent *me;
   bool res;
@@ -370,20 +1457,10 @@ filesystem_is_excluded (const char *path)
     goto err;
   while ((me = getmntent (f)) != NULL)
     {
-      char *p;
-      size_t size;
-
       if (conf_debug_pruning != false)
 	/* This is debuging output, don't mark anything for translation */
 	fprintf (stderr, " `%s', type `%s'\n", me->mnt_dir, me->mnt_type);
-      size = strlen (me->mnt_type) + 1;
-      while (size > type_size)
-	type = x2realloc (type, &type_size);
-      memcpy (type, me->mnt_type, size);
-      for (p = type; *p != 0; p++)
-	*p = toupper((unsigned char)*p);
-      if (bsearch (type, conf_prunefs.entries, conf_prunefs.len,
-		   sizeof (*conf_prunefs.entries), cmp_string_pointer) != NULL)
+      if (filesystem_type_is_excluded (me->mnt_type))
 	{
 	  char *dir;
 
@@ -417,94 +1494,1497 @@ filesystem_is_excluded (const char *path)
   return res;
 }
 
- /* Filesystem scanning */
-
-/* The new database */
-static FILE *new_db;
-/* A _temporary_ file name, or NULL if there is no temporary file */
-static char *new_db_filename;
+ /* Unlinking of temporary database file */
 
-/* Global obstacks for filesystem scanning */
-static struct dir_state scan_dir_state;
+/* Temporary files */
+enum { UNLINK_DB, UNLINK_CHANGELOG, NUM_UNLINK };
 
-/* Next conf_prunepaths entry */
-static size_t conf_prunepaths_index; /* = 0; */
+/* Absolute paths to the files to unlink or NULL */
+static const char *unlink_paths[NUM_UNLINK]; /* = { NULL, }; */
 
-/* Forward declaration */
-static int scan (char *path, int *cwd_fd, const struct stat *st_parent,
-		 const char *relative);
+/* Signals which try to unlink unlink_paths */
+static sigset_t unlink_sigset;
 
-/* Write DIR to new_db. */
+/* Unlink unlink_paths */
 static void
-write_directory (const struct directory *dir)
+unlink_db (void)
 {
-  struct db_directory header;
-  struct db_entry entry;
   size_t i;
 
-  memset (&header, 0, sizeof (header));
-  header.time_sec = htonll (dir->time.sec);
-  assert (dir->time.nsec < 1000000000);
-  header.time_nsec = htonl (dir->time.nsec);
-  fwrite (&header, sizeof (header), 1, new_db);
-  fwrite (dir->path, 1, strlen (dir->path) + 1, new_db);
-  for (i = 0; i < dir->num_entries; i++)
+  for (i = 0; i < NUM_UNLINK; i++)
     {
-      struct entry *e;
-
-      e = dir->entries[i];
-      entry.type = e->is_directory != false ? DBE_DIRECTORY : DBE_NORMAL;
-      fwrite (&entry, sizeof (entry), 1, new_db);
-      fwrite (e->name, 1, e->name_size, new_db);
+      if (unlink_paths[i] != NULL)
+	unlink (unlink_paths[i]);
     }
-  entry.type = DBE_END;
-  fwrite (&entry, sizeof (entry), 1, new_db);
 }
 
-/* Scan subdirectories of the current working directory, which has ST, among
-   entries in DIR, and write results to new_db.  The current working directory
-   is not guaranteed to be preserved on return from this function. */
-static void
-scan_subdirs (const struct directory *dir, const struct stat *st)
+/* SIGINT/SIGTERM handler */
+static void attribute__ ((noreturn))
+unlink_signal (int sig)
 {
-  char *path;
-  int cwd_fd;
-  size_t path_size, prefix_len, i;
-
-  prefix_len = strlen (dir->path);
-  path_size = prefix_len + 1;
-  path = xmalloc (path_size);
-  memcpy (path, dir->path, prefix_len);
-  assert (prefix_len != 0);
-  if (dir->path[prefix_len - 1] != '/') /* "/" => "/bin", not "//bin" */
-    {
-      path[prefix_len] = '/';
-      prefix_len++;
-    }
-  cwd_fd = -1;
-  for (i = 0; i < dir->num_entries; i++)
-    {
-      struct entry *e;
+  sigset_t mask;
 
-      e = dir->entries[i];
-      if (e->is_directory != false)
-	{
-	  /* Verified in copy_old_dir () and scan_cwd () */
-	  while (prefix_len + e->name_size > path_size)
-	    path = x2realloc (path, &path_size);
-	  memcpy (path + prefix_len, e->name, e->name_size);
-	  if (scan (path, &cwd_fd, st, e->name) != 0)
-	    goto err_cwd_fd;
-	}
-    }
- err_cwd_fd:
-  if (cwd_fd != -1)
-    close (cwd_fd);
-  free (path);
+  unlink_db ();
+  signal (sig, SIG_DFL);
+  sigemptyset (&mask);
+  sigaddset (&mask, sig);
+  sigprocmask (SIG_UNBLOCK, &mask, NULL);
+  raise (sig);
+  _exit (EXIT_FAILURE);
 }
 
-/* If *CWD_FD != -1, open ".", store fd to *CWD_FD; then chdir (RELATIVE),
-   failing if there is a race condition; RELATIVE is supposed to match OLD_ST.
+/* Set unlink_paths[WHICH] to PATH (which must remain valid until next
+   unlink_set () */
+static void
+unlink_set (int which, const char *path)
+{
+  sigset_t old;
+
+  sigprocmask (SIG_BLOCK, &unlink_sigset, &old);
+  unlink_paths[which] = path;
+  sigprocmask (SIG_SETMASK, &old, NULL);
+}
+
+/* Initialize the unlinking code */
+static void
+unlink_init (void)
+{
+  static const int signals[] = { SIGABRT, SIGINT, SIGTERM };
+
+  struct sigaction sa;
+  size_t i;
+
+  atexit (unlink_db);
+  sigemptyset (&unlink_sigset);
+  for (i = 0; i < ARRAY_SIZE(signals); i++)
+    sigaddset (&unlink_sigset, signals[i]);
+  sa.sa_handler = unlink_signal;
+  sa.sa_mask = unlink_sigset;
+  sa.sa_flags = 0;
+  for (i = 0; i < ARRAY_SIZE(signals); i++)
+    sigaction (signals[i], &sa, NULL);
+}
+
+ /* I/O throttling */
+
+/* Time at which the next directory may be checked according to
+   conf_max_dir_rate, in microseconds */
+static uint64_t throttle_next_dir; /* = 0; */
+/* Time of the next check of I/O pressure */
+static time_t throttle_next_pressure_check; /* = 0; */
+/* true if the I/O pressure could not be read */
+static bool throttle_pressure_failed; /* = false; */
+/* Total time spent waiting because of conf_max_io_pressure, in seconds */
+static unsigned long throttle_pressure_wait; /* = 0; */
+/* Total time spent waiting because of conf_max_dir_rate, in microseconds */
+static uint64_t throttle_rate_wait; /* = 0; */
+
+/* Return current time in microseconds */
+static uint64_t
+throttle_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Read the share of the last 10 seconds in which some tasks were stalled on
+   I/O, in hundredths of a percent, to *PRESSURE.  Return 0 if OK, -1 on
+   error. */
+static int
+io_pressure_read (unsigned long *pressure)
+{
+  char buf[256], *p;
+  unsigned long value;
+  size_t size;
+  int fd, digits;
+
+  fd = open (PRESSURE_IO_PATH, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  size = safe_read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (size == SAFE_READ_ERROR)
+    return -1;
+  buf[size] = 0;
+  /* "some avg10=1.23 avg60=..."; don't use strtod (), the decimal point does
+     not depend on locale. */
+  p = strstr (buf, "some avg10=");
+  if (p == NULL)
+    goto err;
+  p += strlen ("some avg10=");
+  if (!isdigit ((unsigned char)*p))
+    goto err;
+  value = 0;
+  while (isdigit ((unsigned char)*p))
+    {
+      value = value * 10 + (*p - '0');
+      p++;
+    }
+  digits = 0;
+  if (*p == '.')
+    {
+      p++;
+      while (isdigit ((unsigned char)*p))
+	{
+	  if (digits < 2)
+	    {
+	      value = value * 10 + (*p - '0');
+	      digits++;
+	    }
+	  p++;
+	}
+    }
+  for (; digits < 2; digits++)
+    value *= 10;
+  *pressure = value;
+  return 0;
+
+ err:
+  errno = EINVAL;
+  return -1;
+}
+
+/* Prepare for throttling a new database update */
+static void
+throttle_start (void)
+{
+  throttle_next_dir = 0;
+  throttle_next_pressure_check = 0;
+  throttle_pressure_wait = 0;
+  throttle_rate_wait = 0;
+}
+
+/* Wait while the I/O pressure is above conf_max_io_pressure */
+static void
+throttle_pressure (void)
+{
+  unsigned long pressure;
+
+  if (time (NULL) < throttle_next_pressure_check)
+    return;
+  for (;;)
+    {
+      if (io_pressure_read (&pressure) != 0)
+	{
+	  error (0, errno, _("can not read `%s', not limiting I/O pressure"),
+		 PRESSURE_IO_PATH);
+	  throttle_pressure_failed = true;
+	  return;
+	}
+      if (pressure <= conf_max_io_pressure * 100)
+	break;
+      if (conf_debug_throttle != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "I/O pressure %lu.%02lu%% above %lu%%, pausing\n",
+		 pressure / 100, pressure % 100, conf_max_io_pressure);
+      sleep (1);
+      throttle_pressure_wait++;
+    }
+  if (conf_debug_throttle != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "I/O pressure %lu.%02lu%%\n", pressure / 100,
+	     pressure % 100);
+  throttle_next_pressure_check = time (NULL) + 1;
+}
+
+/* Wait if necessary before checking a directory */
+static void
+throttle (void)
+{
+  uint64_t now;
+
+  if (conf_max_io_pressure != 0 && throttle_pressure_failed == false)
+    throttle_pressure ();
+  if (conf_max_dir_rate == 0)
+    return;
+  now = throttle_now ();
+  if (throttle_next_dir > now)
+    {
+      struct timespec ts;
+      uint64_t delay;
+
+      delay = throttle_next_dir - now;
+      ts.tv_sec = delay / 1000000;
+      ts.tv_nsec = (delay % 1000000) * 1000;
+      while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+	;
+      throttle_rate_wait += delay;
+    }
+  else
+    /* Don't allow bursts after a slow period. */
+    throttle_next_dir = now;
+  throttle_next_dir += 1000000 / conf_max_dir_rate;
+}
+
+/* Write throttling statistics to stderr */
+static void
+report_throttling (void)
+{
+  /* This is debuging output, don't mark anything for translation */
+  fprintf (stderr, "Waited %lu seconds because of I/O pressure, %" PRIu64
+	   ".%03" PRIu64 " seconds because of --max-dir-rate\n",
+	   throttle_pressure_wait, throttle_rate_wait / 1000000,
+	   throttle_rate_wait / 1000 % 1000);
+}
+
+ /* Directory prefetching */
+
+/* A subdirectory read by a prefetch thread ahead of scan () */
+struct prefetch
+{
+#ifdef USE_PREFETCH
+  struct prefetch *next;	/* Next in prefetch_queue */
+  enum
+    {
+      PREFETCH_QUEUED,		/* In prefetch_queue */
+      PREFETCH_RUNNING,		/* Being read by a prefetch thread */
+      PREFETCH_DONE		/* Read, or removed from prefetch_queue */
+    } state;
+#endif
+  int parent_fd;		/* The parent directory */
+  dev_t parent_dev;		/* st_dev of parent_fd */
+  char *name;			/* Name of the subdirectory in parent_fd */
+  bool read_entries;		/* Read entries, not only the inode */
+  bool valid;			/* The results below are valid */
+  time_t start;			/* Time the read started */
+  struct stat st;		/* The subdirectory before reading entries */
+  struct stat st_after;		/* The subdirectory after reading entries */
+  /* Entries encoded as in the database, without DBE_END */
+  char *entries;
+  size_t entries_size, entries_used;
+};
+
+#ifdef USE_PREFETCH
+/* Protects prefetch_queue, prefetch_stopping and state of all prefetches */
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when prefetch_queue is not empty or prefetch_stopping is set */
+static pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+/* Signaled when a prefetch becomes PREFETCH_DONE */
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+/* Prefetches waiting for a thread, and the last one */
+static struct prefetch *prefetch_queue; /* = NULL; */
+static struct prefetch **prefetch_queue_tail = &prefetch_queue;
+/* Set to ask the prefetch threads to exit */
+static bool prefetch_stopping; /* = false; */
+
+/* The prefetch threads */
+static pthread_t *prefetch_threads; /* = NULL; */
+static size_t num_prefetch_threads; /* = 0; */
+
+/* Read the subdirectory described by P.  This runs in a prefetch thread, so
+   it must not report errors or exit; scan () reads the subdirectory itself
+   if P is not valid. */
+static void
+prefetch_read (struct prefetch *p)
+{
+  DIR *dir;
+  struct dirent *de;
+  int fd;
+
+  p->start = time (NULL);
+  /* Don't cross to other filesystems: they may be excluded, or may only be
+     mounted by opening them. */
+  if (fstatat (p->parent_fd, p->name, &p->st, AT_SYMLINK_NOFOLLOW) != 0
+      || !S_ISDIR (p->st.st_mode) || p->st.st_dev != p->parent_dev)
+    return;
+  if (p->read_entries == false)
+    {
+      /* Looking up the inode is enough for scan () to find it cached. */
+      p->valid = true;
+      return;
+    }
+  fd = -1;
+#ifdef O_NOATIME
+  fd = openat (p->parent_fd, p->name,
+	       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME);
+  if (fd == -1 && errno != EPERM)
+    return;
+#endif
+  if (fd == -1)
+    fd = openat (p->parent_fd, p->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd == -1)
+    return;
+  if (fstat (fd, &p->st) != 0 || p->st.st_dev != p->parent_dev)
+    {
+      close (fd);
+      return;
+    }
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      close (fd);
+      return;
+    }
+  errno = 0;
+  while ((de = readdir (dir)) != NULL)
+    {
+      size_t name_size;
+      uint8_t type;
+
+      if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+	continue;
+      type = DBE_NORMAL;
+#if defined (HAVE_STRUCT_DIRENT_D_TYPE) && defined (DT_DIR)
+      if (de->d_type == DT_DIR)
+	type = DBE_DIRECTORY;
+      else if (de->d_type == DT_UNKNOWN)
+#endif
+	{
+	  struct stat st;
+
+	  if (fstatat (fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+	      && S_ISDIR (st.st_mode))
+	    type = DBE_DIRECTORY;
+	}
+      name_size = strlen (de->d_name) + 1;
+      while (p->entries_used + sizeof (struct db_entry) + name_size
+	     > p->entries_size)
+	{
+	  char *entries;
+	  size_t size;
+
+	  size = p->entries_size != 0 ? 2 * p->entries_size : 4096;
+	  entries = realloc (p->entries, size);
+	  if (entries == NULL)
+	    goto err_dir;
+	  p->entries = entries;
+	  p->entries_size = size;
+	}
+      p->entries[p->entries_used] = type;
+      memcpy (p->entries + p->entries_used + sizeof (struct db_entry),
+	      de->d_name, name_size);
+      p->entries_used += sizeof (struct db_entry) + name_size;
+      errno = 0;
+    }
+  if (errno != 0 || fstat (fd, &p->st_after) != 0)
+    goto err_dir;
+  p->valid = true;
+ err_dir:
+  closedir (dir);
+}
+
+/* Main function of a prefetch thread */
+static void *
+prefetch_thread (void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock (&prefetch_mutex);
+  for (;;)
+    {
+      struct prefetch *p;
+
+      while (prefetch_queue == NULL && prefetch_stopping == false)
+	pthread_cond_wait (&prefetch_queued, &prefetch_mutex);
+      if (prefetch_stopping != false)
+	break;
+      p = prefetch_queue;
+      prefetch_queue = p->next;
+      if (prefetch_queue == NULL)
+	prefetch_queue_tail = &prefetch_queue;
+      p->state = PREFETCH_RUNNING;
+      pthread_mutex_unlock (&prefetch_mutex);
+      prefetch_read (p);
+      pthread_mutex_lock (&prefetch_mutex);
+      p->state = PREFETCH_DONE;
+      pthread_cond_broadcast (&prefetch_done);
+    }
+  pthread_mutex_unlock (&prefetch_mutex);
+  return NULL;
+}
+#endif
+
+/* Start the prefetch threads, if requested */
+static void
+prefetch_start (void)
+{
+#ifdef USE_PREFETCH
+  sigset_t sigset, old_sigset;
+
+  if (conf_prefetch == 0)
+    return;
+  /* Leave signal handling, notably unlink_signal (), to the main thread. */
+  sigfillset (&sigset);
+  pthread_sigmask (SIG_SETMASK, &sigset, &old_sigset);
+  prefetch_threads = XNMALLOC (conf_prefetch, pthread_t);
+  for (num_prefetch_threads = 0; num_prefetch_threads < conf_prefetch;
+       num_prefetch_threads++)
+    {
+      int err;
+
+      err = pthread_create (prefetch_threads + num_prefetch_threads, NULL,
+			    prefetch_thread, NULL);
+      if (err != 0)
+	{
+	  /* Fewer threads are good enough. */
+	  if (num_prefetch_threads == 0)
+	    error (0, err, _("can not start a prefetch thread"));
+	  break;
+	}
+    }
+  pthread_sigmask (SIG_SETMASK, &old_sigset, NULL);
+#endif
+}
+
+/* Stop the prefetch threads, if any */
+static void
+prefetch_stop (void)
+{
+#ifdef USE_PREFETCH
+  size_t i;
+
+  if (num_prefetch_threads == 0)
+    return;
+  pthread_mutex_lock (&prefetch_mutex);
+  /* scan_subdirs () waits for all its prefetches. */
+  assert (prefetch_queue == NULL);
+  prefetch_stopping = true;
+  pthread_cond_broadcast (&prefetch_queued);
+  pthread_mutex_unlock (&prefetch_mutex);
+  for (i = 0; i < num_prefetch_threads; i++)
+    pthread_join (prefetch_threads[i], NULL);
+  free (prefetch_threads);
+  prefetch_threads = NULL;
+  num_prefetch_threads = 0;
+  prefetch_stopping = false;
+#endif
+}
+
+/* Return true if prefetch threads are running */
+static bool
+prefetch_running (void)
+{
+#ifdef USE_PREFETCH
+  return num_prefetch_threads != 0;
+#else
+  return false;
+#endif
+}
+
+/* Ask a prefetch thread to look up subdirectory NAME of PARENT_FD on device
+   PARENT_DEV, and to read its entries if READ_ENTRIES.  Return the prefetch,
+   or NULL if prefetch threads are not running. */
+static struct prefetch *
+prefetch_submit (int parent_fd, dev_t parent_dev, const char *name,
+		 bool read_entries)
+{
+  struct prefetch *p;
+
+  if (prefetch_running () == false)
+    return NULL;
+  p = xzalloc (sizeof (*p));
+  p->parent_fd = parent_fd;
+  p->parent_dev = parent_dev;
+  p->name = xstrdup (name);
+  p->read_entries = read_entries;
+#ifdef USE_PREFETCH
+  p->state = PREFETCH_QUEUED;
+  pthread_mutex_lock (&prefetch_mutex);
+  *prefetch_queue_tail = p;
+  prefetch_queue_tail = &p->next;
+  pthread_cond_signal (&prefetch_queued);
+  pthread_mutex_unlock (&prefetch_mutex);
+#endif
+  return p;
+}
+
+/* Wait until P is read, or remove it from prefetch_queue if no thread has
+   started reading it yet.  P->valid is final after this. */
+static void
+prefetch_wait (struct prefetch *p)
+{
+#ifdef USE_PREFETCH
+  pthread_mutex_lock (&prefetch_mutex);
+  if (p->state == PREFETCH_QUEUED)
+    {
+      struct prefetch **q;
+
+      for (q = &prefetch_queue; *q != p; q = &(*q)->next)
+	;
+      *q = p->next;
+      if (prefetch_queue_tail == &p->next)
+	prefetch_queue_tail = q;
+      p->state = PREFETCH_DONE;
+    }
+  while (p->state != PREFETCH_DONE)
+    pthread_cond_wait (&prefetch_done, &prefetch_mutex);
+  pthread_mutex_unlock (&prefetch_mutex);
+#endif
+}
+
+/* Free P, waiting for its prefetch thread if necessary */
+static void
+prefetch_free (struct prefetch *p)
+{
+  prefetch_wait (p);
+  free (p->name);
+  free (p->entries);
+  free (p);
+}
+
+ /* Scan reports */
+
+/* Events during scanning, counted in report_counters */
+enum report_counter
+  {
+    REPORT_REUSED,		/* Directory records copied from the old database */
+    REPORT_NEW,			/* Directories read, not in the old database */
+    REPORT_CHANGED,		/* Directories read because they changed */
+    /* Directories read because their old records were marked as too current,
+       see time_is_current () */
+    REPORT_FORCED,
+    REPORT_LOOKUPS,		/* lstat () or statx () calls */
+    REPORT_READS,		/* Directories opened and read */
+    REPORT_NUM_COUNTERS
+  };
+
+/* Statistics of a part of the scanned tree */
+struct report_stats
+{
+  uintmax_t counters[REPORT_NUM_COUNTERS];
+  uintmax_t bytes;		/* Bytes written to the new database */
+  uint64_t usec;		/* Time spent, in microseconds */
+};
+
+/* A top-level subtree or a filesystem in the report */
+struct report_part
+{
+  char *name;			/* Path of the subtree or mount point */
+  dev_t dev;			/* The filesystem */
+  struct report_stats stats;
+};
+
+/* Number of events of each kind since the start of the program */
+static uintmax_t report_counters[REPORT_NUM_COUNTERS];
+/* report_counters at the start of the database update */
+static uintmax_t report_start_counters[REPORT_NUM_COUNTERS];
+
+/* Top-level subtrees, in scanning order */
+static struct report_part *report_subtrees; /* = NULL; */
+static size_t report_subtrees_size; /* = 0; */
+static size_t num_report_subtrees; /* = 0; */
+/* Filesystems, in order of the first visit */
+static struct report_part *report_filesystems; /* = NULL; */
+static size_t report_filesystems_size; /* = 0; */
+static size_t num_report_filesystems; /* = 0; */
+/* The top-level subtree being scanned, or NULL if scanning conf_scan_root
+   itself */
+static const char *report_subtree_path; /* = NULL; */
+/* Time the database update started, in microseconds */
+static uint64_t report_start_time;
+
+/* Prepare for reporting about a new database update */
+static void
+report_start (void)
+{
+  size_t i;
+
+  memcpy (report_start_counters, report_counters,
+	  sizeof (report_start_counters));
+  report_start_time = throttle_now ();
+  if (conf_report == NULL)
+    return;
+  for (i = 0; i < num_report_subtrees; i++)
+    free (report_subtrees[i].name);
+  num_report_subtrees = 0;
+  for (i = 0; i < num_report_filesystems; i++)
+    free (report_filesystems[i].name);
+  num_report_filesystems = 0;
+  report_subtree_path = NULL;
+}
+
+/* Record the state at POSITION of the new database to MARK */
+static void
+report_mark (struct report_stats *mark, off_t position)
+{
+  if (conf_report == NULL)
+    return;
+  memcpy (mark->counters, report_counters, sizeof (mark->counters));
+  mark->bytes = position;
+  mark->usec = throttle_now ();
+}
+
+/* Return the part in PARTS with NUM and SIZE for NAME and DEV, adding it if
+   it is not the last one */
+static struct report_part *
+report_part (struct report_part **parts, size_t *num, size_t *size,
+	     const char *name, dev_t dev)
+{
+  struct report_part *part;
+
+  if (*num != 0)
+    {
+      part = *parts + *num - 1;
+      if (strcmp (part->name, name) == 0 && part->dev == dev)
+	return part;
+    }
+  if (*num == *size)
+    *parts = x2nrealloc (*parts, size, sizeof (**parts));
+  part = *parts + *num;
+  (*num)++;
+  memset (part, 0, sizeof (*part));
+  part->name = xstrdup (name);
+  part->dev = dev;
+  return part;
+}
+
+/* Add events since MARK, with the new database at POSITION, to the current
+   subtree and to the filesystem DEV; PATH is the directory being scanned. */
+static void
+report_add (const struct report_stats *mark, off_t position, dev_t dev,
+	    const char *path)
+{
+  struct report_stats diff;
+  struct report_part *parts[2];
+  size_t i, j;
+
+  if (conf_report == NULL)
+    return;
+  for (i = 0; i < REPORT_NUM_COUNTERS; i++)
+    diff.counters[i] = report_counters[i] - mark->counters[i];
+  diff.bytes = position - mark->bytes;
+  diff.usec = throttle_now () - mark->usec;
+  /* conf_scan_root is always the first subtree. */
+  if (report_subtree_path == NULL && num_report_subtrees != 0)
+    parts[0] = report_subtrees;
+  else
+    parts[0] = report_part (&report_subtrees, &num_report_subtrees,
+			    &report_subtrees_size,
+			    (report_subtree_path != NULL ? report_subtree_path
+			     : conf_scan_root), 0);
+  parts[1] = NULL;
+  for (i = 0; i < num_report_filesystems; i++)
+    {
+      if (report_filesystems[i].dev == dev)
+	{
+	  parts[1] = report_filesystems + i;
+	  break;
+	}
+    }
+  /* The first directory seen on a filesystem is its mount point, or
+     conf_scan_root. */
+  if (parts[1] == NULL)
+    parts[1] = report_part (&report_filesystems, &num_report_filesystems,
+			    &report_filesystems_size, path, dev);
+  for (i = 0; i < ARRAY_SIZE (parts); i++)
+    {
+      for (j = 0; j < REPORT_NUM_COUNTERS; j++)
+	parts[i]->stats.counters[j] += diff.counters[j];
+      parts[i]->stats.bytes += diff.bytes;
+      parts[i]->stats.usec += diff.usec;
+    }
+}
+
+/* Write a line of the report about STATS of NAME with TYPE to F */
+static void
+report_write_line (FILE *f, const char *kind, const char *name,
+		   const char *type, const struct report_stats *stats)
+{
+  const uintmax_t *c;
+
+  c = stats->counters;
+  fprintf (f, "%s\t%s\t%s\t%ju\t%ju\t%ju\t%ju\t%ju\t%ju\t%ju\t%ju\t%" PRIu64
+	   ".%03" PRIu64 "\n", kind, name, type,
+	   c[REPORT_REUSED] + c[REPORT_NEW] + c[REPORT_CHANGED]
+	   + c[REPORT_FORCED], c[REPORT_REUSED], c[REPORT_NEW],
+	   c[REPORT_CHANGED], c[REPORT_FORCED], c[REPORT_LOOKUPS],
+	   c[REPORT_READS], stats->bytes, stats->usec / 1000000,
+	   stats->usec / 1000 % 1000);
+}
+
+/* Replace conf_report by a report about the database update, which wrote
+   DB_SIZE bytes.  Exit on error. */
+static void
+report_write (off_t db_size)
+{
+  struct report_stats total;
+  char **types, *filename;
+  FILE *f, *mounts;
+  size_t *type_lens, i, j;
+  int fd;
+
+  if (conf_report == NULL)
+    return;
+  memset (&total, 0, sizeof (total));
+  for (i = 0; i < num_report_subtrees; i++)
+    {
+      const struct report_stats *stats;
+
+      stats = &report_subtrees[i].stats;
+      for (j = 0; j < REPORT_NUM_COUNTERS; j++)
+	total.counters[j] += stats->counters[j];
+    }
+  /* Including the database header */
+  total.bytes = db_size;
+  total.usec = throttle_now () - report_start_time;
+  /* Filesystem types, from the closest mount point above the first directory
+     seen on each filesystem; the filesystems are not accessed again. */
+  types = xcalloc (num_report_filesystems, sizeof (*types));
+  type_lens = xcalloc (num_report_filesystems, sizeof (*type_lens));
+  mounts = setmntent (MOUNT_TABLE_PATH, "r");
+  if (mounts != NULL)
+    {
+      struct mntent *me;
+
+      while ((me = getmntent (mounts)) != NULL)
+	{
+	  size_t len;
+
+	  len = strlen (me->mnt_dir);
+	  for (i = 0; i < num_report_filesystems; i++)
+	    {
+	      /* Later entries are mounted over earlier ones. */
+	      if (path_is_within (report_filesystems[i].name, me->mnt_dir, len)
+		  && (types[i] == NULL || len >= type_lens[i]))
+		{
+		  free (types[i]);
+		  types[i] = xstrdup (me->mnt_type);
+		  type_lens[i] = len;
+		}
+	    }
+	}
+      endmntent (mounts);
+    }
+  free (type_lens);
+  filename = xmalloc (strlen (conf_report) + 8);
+  sprintf (filename, "%s.XXXXXX", conf_report);
+  fd = mkstemp (filename);
+  if (fd == -1)
+    error (EXIT_FAILURE, errno, _("can not open a temporary file for `%s'"),
+	   conf_report);
+  f = fdopen (fd, "w");
+  if (f == NULL)
+    error (EXIT_FAILURE, errno, _("can not open a temporary file for `%s'"),
+	   conf_report);
+  fputs ("#kind\tname\ttype\tdirs\treused\tnew\tchanged\tforced\tlookups\t"
+	 "reads\tbytes\tseconds\n", f);
+  report_write_line (f, "total", conf_scan_root, "-", &total);
+  for (i = 0; i < num_report_subtrees; i++)
+    report_write_line (f, "subtree", report_subtrees[i].name, "-",
+		       &report_subtrees[i].stats);
+  for (i = 0; i < num_report_filesystems; i++)
+    {
+      report_write_line (f, "filesystem", report_filesystems[i].name,
+			 types[i] != NULL ? types[i] : "-",
+			 &report_filesystems[i].stats);
+      free (types[i]);
+    }
+  free (types);
+  if (fwriteerror (f))
+    {
+      unlink (filename);
+      error (EXIT_FAILURE, errno, _("I/O error while writing to `%s'"),
+	     filename);
+    }
+  if (rename (filename, conf_report) != 0)
+    {
+      unlink (filename);
+      error (EXIT_FAILURE, errno, _("error replacing `%s'"), conf_report);
+    }
+  free (filename);
+}
+
+/* Replace conf_metrics by metrics of the database update, which wrote
+   DB_SIZE bytes and NUM_ENTRIES entries.  Exit on error. */
+static void
+report_metrics (off_t db_size, uintmax_t num_entries)
+{
+  static const struct
+  {
+    enum report_counter counter;
+    const char *labels;
+  } reads[] =
+    {
+      { REPORT_NEW, "{reason=\"new\"}" },
+      { REPORT_CHANGED, "{reason=\"changed\"}" },
+      { REPORT_FORCED, "{reason=\"forced\"}" }
+    };
+
+  struct metrics m;
+  size_t family, i;
+
+  if (conf_metrics == NULL)
+    return;
+  metrics_init (&m);
+  family = metrics_family (&m, "updatedb_last_run_timestamp_seconds",
+			   METRICS_GAUGE,
+			   "Time the last database update finished.");
+  metrics_add (&m, family, "", metrics_now ());
+  family = metrics_family (&m, "updatedb_run_duration_seconds", METRICS_GAUGE,
+			   "Duration of the last database update.");
+  metrics_add (&m, family, "",
+	       (throttle_now () - report_start_time) / 1000000.0);
+  family = metrics_family (&m, "updatedb_directories_read", METRICS_GAUGE,
+			   "Directories read in the last database update.");
+  for (i = 0; i < ARRAY_SIZE (reads); i++)
+    metrics_add (&m, family, reads[i].labels,
+		 report_counters[reads[i].counter]
+		 - report_start_counters[reads[i].counter]);
+  family = metrics_family (&m, "updatedb_directories_reused", METRICS_GAUGE,
+			   "Directories reused from the old database in the "
+			   "last database update.");
+  metrics_add (&m, family, "", (report_counters[REPORT_REUSED]
+				- report_start_counters[REPORT_REUSED]));
+  family = metrics_family (&m, "updatedb_entries_written", METRICS_GAUGE,
+			   "Directory entries written in the last database "
+			   "update.");
+  metrics_add (&m, family, "", num_entries);
+  family = metrics_family (&m, "updatedb_database_size_bytes", METRICS_GAUGE,
+			   "Size of the database, or of the delta, written in "
+			   "the last database update.");
+  metrics_add (&m, family, "", db_size);
+  if (metrics_write (&m, conf_metrics, false) != 0)
+    error (EXIT_FAILURE, errno, _("I/O error while writing to `%s'"),
+	   conf_metrics);
+  metrics_free (&m);
+}
+
+ /* Filesystem scanning */
+
+/* The new database */
+static int new_db_fd;
+/* A _temporary_ file name, or NULL if there is no temporary file */
+static char *new_db_filename;
+
+/* Size of new_db_buffer; large enough for any single entry. */
+enum { NEW_DB_BUFFER_SIZE = 4 * 1024 * 1024 };
+/* Encoded records not yet written to new_db_fd */
+static char *new_db_buffer;
+/* Number of bytes used in new_db_buffer */
+static size_t new_db_buffer_used; /* = 0; */
+/* errno value of the first error writing new_db_fd, or 0 */
+static int new_db_errno; /* = 0; */
+/* Number of bytes written to new_db_fd, not counting new_db_buffer */
+static off_t new_db_offset; /* = 0; */
+/* Number of directory entries written to new_db_fd */
+static uintmax_t new_db_entries; /* = 0; */
+/* Offset of the last directory header written to new_db_fd */
+static off_t new_db_dir_offset; /* = 0; */
+
+/* Directory entries for filesystem scanning */
+static struct dir_state scan_dir_state;
+
+/* Next conf_prunepaths entry */
+static size_t conf_prunepaths_index; /* = 0; */
+
+/* Directories known to be changed since the old database was written, sorted
+   by dir_path_cmp (), or NULL if all directories should be checked */
+static const struct string_list *scan_changed_dirs; /* = NULL; */
+/* Mount points of filesystems in which changes are not reported */
+static struct string_list scan_unwatched_dirs; /* = { 0, }; */
+/* true if some records trusted from the old database could not be copied */
+static bool scan_incomplete; /* = false; */
+
+/* true if scan () should skip directories not on mount_worker_dev */
+static bool mount_worker_dev_only; /* = false; */
+/* The filesystem read by this mount worker */
+static dev_t mount_worker_dev;
+
+/* Time at which conf_time_budget runs out */
+static time_t budget_deadline;
+/* The directory at which the previous run ran out of conf_time_budget, or
+   NULL */
+static char *budget_resume_path; /* = NULL; */
+/* The first directory not read because conf_time_budget ran out, or NULL */
+static char *budget_stop_path; /* = NULL; */
+
+/* The top-level directories checked in this run are those with index modulo
+   conf_stagger equal to stagger_slot */
+static unsigned long stagger_slot; /* = 0; */
+/* Index of the next top-level directory */
+static unsigned long stagger_index; /* = 0; */
+
+/* The prefetch of the directory scan () is called for next, or NULL */
+static struct prefetch *scan_next_prefetch; /* = NULL; */
+
+/* Time of the next checkpoint */
+static time_t checkpoint_next; /* = 0; */
+/* true if a checkpoint of new_db_fd was written */
+static bool checkpoint_written; /* = false; */
+
+/* Forward declaration */
+static int scan (char *path, int *cwd_fd, const struct stat *st_parent,
+		 const char *relative);
+
+/* Write DATA with SIZE directly to new_db_fd */
+static void
+new_db_write_direct (const void *data, size_t size)
+{
+  if (new_db_errno != 0)
+    return;
+  if (full_write (new_db_fd, data, size) != size)
+    new_db_errno = errno != 0 ? errno : EIO;
+  else
+    new_db_offset += size;
+}
+
+/* Write contents of new_db_buffer to new_db_fd */
+static void
+new_db_flush (void)
+{
+  new_db_write_direct (new_db_buffer, new_db_buffer_used);
+  new_db_buffer_used = 0;
+}
+
+/* Return a pointer to SIZE bytes at the end of new_db_buffer, which will be
+   written to new_db_fd; SIZE must be at most NEW_DB_BUFFER_SIZE. */
+static char *
+new_db_reserve (size_t size)
+{
+  char *res;
+
+  assert (size <= NEW_DB_BUFFER_SIZE);
+  if (size > NEW_DB_BUFFER_SIZE - new_db_buffer_used)
+    new_db_flush ();
+  res = new_db_buffer + new_db_buffer_used;
+  new_db_buffer_used += size;
+  return res;
+}
+
+/* Write DATA with SIZE to new_db_fd, through new_db_buffer if practical */
+static void
+new_db_write (const void *data, size_t size)
+{
+  if (size > NEW_DB_BUFFER_SIZE - new_db_buffer_used)
+    {
+      new_db_flush ();
+      if (size > NEW_DB_BUFFER_SIZE / 2)
+	{
+	  new_db_write_direct (data, size);
+	  return;
+	}
+    }
+  memcpy (new_db_buffer + new_db_buffer_used, data, size);
+  new_db_buffer_used += size;
+}
+
+/* Write a record marking PATH as removed to new_db_fd */
+static void
+delta_write_removed (const char *path)
+{
+  struct db_directory header;
+
+  memset (&header, 0, sizeof (header));
+  header.time_nsec = htonl (DB_NSEC_REMOVED);
+  new_db_write (&header, sizeof (header));
+  new_db_write (path, strlen (path) + 1);
+  *new_db_reserve (sizeof (struct db_entry)) = DBE_END;
+}
+
+/* Note that a record of PATH, if not NULL, is present in the new delta,
+   either written to new_db_fd or unchanged in old_base.  Write removal
+   records for the preceding old_base records which are not present. */
+static void
+delta_record (const char *path)
+{
+  size_t src, dest;
+
+  dest = 0;
+  for (src = 0; src < delta_pending.len; src++)
+    {
+      char *p;
+      int cmp;
+
+      p = delta_pending.entries[src];
+      cmp = path != NULL ? dir_path_cmp (p, path) : -1;
+      if (cmp > 0)
+	{
+	  delta_pending.entries[dest] = p;
+	  dest++;
+	  continue;
+	}
+      if (cmp < 0)
+	delta_write_removed (p);
+      free (p);
+    }
+  delta_pending.len = dest;
+  if (path != NULL)
+    {
+      free (delta_last_path);
+      delta_last_path = xstrdup (path);
+    }
+}
+
+/* Note that the old_base record of PATH was read */
+static void
+delta_base_record_done (const char *path)
+{
+  if (delta_last_path == NULL || strcmp (path, delta_last_path) != 0)
+    string_list_append (&delta_pending, xstrdup (path));
+}
+
+/* Write removal records for all remaining old_base records not present in
+   the new delta */
+static void
+delta_finish (void)
+{
+  old_dir_skip_rest ();
+  delta_record (NULL);
+  free (delta_last_path);
+  delta_last_path = NULL;
+}
+
+/* Write header of DIR to new_db_fd. */
+static void
+write_directory_header (const struct directory *dir)
+{
+  struct db_directory header;
+
+  if (new_db_is_delta != false)
+    delta_record (dir->path);
+
+  new_db_dir_offset = new_db_offset + new_db_buffer_used;
+  memset (&header, 0, sizeof (header));
+  header.time_sec = htonll (dir->time.sec);
+  assert (dir->time.nsec < 1000000000);
+  header.time_nsec = htonl (dir->time.nsec);
+  new_db_write (&header, sizeof (header));
+  new_db_write (dir->path, strlen (dir->path) + 1);
+}
+
+/* Write DIR to new_db_fd. */
+static void
+write_directory (const struct directory *dir)
+{
+  size_t i;
+
+  write_directory_header (dir);
+  if (changelog_file != NULL)
+    changelog_dir_start (dir->path);
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      const char *e;
+      size_t size;
+
+      e = dir_entry (&scan_dir_state, dir, i);
+      size = sizeof (struct db_entry) + strlen (e + sizeof (struct db_entry))
+	+ 1;
+      if (changelog_file != NULL)
+	changelog_entry (dir->path, e + sizeof (struct db_entry));
+      /* Verified in copy_old_dir () and scan_cwd () */
+      {
+	verify (sizeof (struct db_entry) + OBSTACK_SIZE_MAX
+		<= NEW_DB_BUFFER_SIZE);
+      }
+      memcpy (new_db_reserve (size), e, size);
+    }
+  *new_db_reserve (sizeof (struct db_entry)) = DBE_END;
+  new_db_entries += dir->num_entries;
+  if (changelog_file != NULL)
+    changelog_dir_end (dir->path);
+}
+
+/* Size of buffers used for spill_fd */
+enum { SPILL_BUFFER_SIZE = 64 * 1024 };
+
+/* A sorted run of entries in spill_fd */
+struct spill_run
+{
+  off_t offset;			/* Offset of data after buf */
+  off_t end;			/* End of the run */
+  char *buf;			/* Read buffer */
+  size_t buf_pos, buf_len;
+  char *entry;			/* Current entry, encoded as in the database */
+  size_t entry_size;		/* Allocated size of entry */
+};
+
+/* Temporary file for sorted runs of entries of a directory that does not fit
+   into conf_max_memory, or -1 */
+static int spill_fd = -1;
+/* Ends of runs in spill_fd */
+static off_t *spill_run_ends;
+static size_t spill_num_runs, spill_run_ends_size; /* = 0; */
+/* Write buffer for spill_fd */
+static char *spill_buffer;
+static size_t spill_buffer_used; /* = 0; */
+/* Offset of data after spill_buffer */
+static off_t spill_size; /* = 0; */
+/* Statistics for report_memory_use () */
+static size_t spill_total_dirs, spill_total_runs; /* = 0; */
+
+/* Write contents of spill_buffer to spill_fd.  Exit on error. */
+static void
+spill_flush (void)
+{
+  if (full_write (spill_fd, spill_buffer, spill_buffer_used)
+      != spill_buffer_used)
+    error (EXIT_FAILURE, errno, _("I/O error while writing a temporary file"));
+  spill_size += spill_buffer_used;
+  spill_buffer_used = 0;
+}
+
+/* Write sorted entries of DIR, which is on top of STATE, as a new run to
+   spill_fd, and remove them from STATE.  Exit on error. */
+static void
+spill_dir (struct directory *dir, struct dir_state *state)
+{
+  size_t i;
+
+  if (spill_fd == -1)
+    {
+      char *filename;
+
+      filename = xmalloc (strlen (conf_output) + 8);
+      sprintf (filename, "%s.XXXXXX", conf_output);
+      spill_fd = mkstemp (filename);
+      if (spill_fd == -1)
+	error (EXIT_FAILURE, errno,
+	       _("can not open a temporary file for `%s'"), conf_output);
+      unlink (filename);
+      free (filename);
+      spill_buffer = xmalloc (SPILL_BUFFER_SIZE);
+    }
+  if (dir->spilled == false)
+    spill_total_dirs++;
+  dir_finish (dir, state, true);
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      const char *e;
+      size_t size;
+
+      e = dir_entry (state, dir, i);
+      size = sizeof (struct db_entry) + strlen (e + sizeof (struct db_entry))
+	+ 1;
+      if (size > SPILL_BUFFER_SIZE - spill_buffer_used)
+	spill_flush ();
+      if (size > SPILL_BUFFER_SIZE)
+	{
+	  if (full_write (spill_fd, e, size) != size)
+	    error (EXIT_FAILURE, errno,
+		   _("I/O error while writing a temporary file"));
+	  spill_size += size;
+	}
+      else
+	{
+	  memcpy (spill_buffer + spill_buffer_used, e, size);
+	  spill_buffer_used += size;
+	}
+    }
+  spill_flush ();
+  if (spill_num_runs == spill_run_ends_size)
+    spill_run_ends = x2nrealloc (spill_run_ends, &spill_run_ends_size,
+				 sizeof (*spill_run_ends));
+  spill_run_ends[spill_num_runs] = spill_size;
+  spill_num_runs++;
+  spill_total_runs++;
+  dir_free (dir, state);
+  dir->num_entries = 0;
+  dir->spilled = true;
+}
+
+/* Forget all runs in spill_fd */
+static void
+spill_discard (void)
+{
+  spill_num_runs = 0;
+  spill_size = 0;
+  if (spill_fd != -1
+      && (ftruncate (spill_fd, 0) != 0 || lseek (spill_fd, 0, SEEK_SET) != 0))
+    error (EXIT_FAILURE, errno, _("I/O error while writing a temporary file"));
+}
+
+/* Read next entry of RUN to RUN->entry.  Return false at the end of RUN.  Exit
+   on error. */
+static bool
+spill_run_next (struct spill_run *run)
+{
+  size_t len;
+
+  if (run->buf_pos == run->buf_len && run->offset == run->end)
+    return false;
+  len = 0;
+  for (;;)
+    {
+      const char *p, *nul;
+      size_t run_len;
+
+      if (run->buf_pos == run->buf_len)
+	{
+	  ssize_t res;
+
+	  run_len = SPILL_BUFFER_SIZE;
+	  if ((off_t)run_len > run->end - run->offset)
+	    run_len = run->end - run->offset;
+	  if (run_len == 0)
+	    error (EXIT_FAILURE, 0, _("invalid data in a temporary file"));
+	  res = pread (spill_fd, run->buf, run_len, run->offset);
+	  if (res <= 0)
+	    {
+	      if (res == -1 && errno == EINTR)
+		continue;
+	      error (EXIT_FAILURE, res == 0 ? 0 : errno,
+		     _("I/O error while reading a temporary file"));
+	    }
+	  run->offset += res;
+	  run->buf_pos = 0;
+	  run->buf_len = res;
+	}
+      p = run->buf + run->buf_pos;
+      run_len = run->buf_len - run->buf_pos;
+      if (len == 0)
+	/* The type byte may be 0 as well. */
+	nul = run_len > 1 ? memchr (p + 1, 0, run_len - 1) : NULL;
+      else
+	nul = memchr (p, 0, run_len);
+      if (nul != NULL)
+	run_len = nul - p + 1;
+      while (len + run_len > run->entry_size)
+	run->entry = x2realloc (run->entry, &run->entry_size);
+      memcpy (run->entry + len, p, run_len);
+      len += run_len;
+      run->buf_pos += run_len;
+      if (nul != NULL)
+	return true;
+    }
+}
+
+/* Compare current entries of "struct spill_run *" values A and B */
+static int
+cmp_spill_runs (const struct spill_run *a, const struct spill_run *b)
+{
+  return strcmp (a->entry + sizeof (struct db_entry),
+		 b->entry + sizeof (struct db_entry));
+}
+
+/* Restore the heap property of HEAP with NUM elements, assuming it could only
+   be violated by HEAP[I]. */
+static void
+spill_heap_down (struct spill_run **heap, size_t num, size_t i)
+{
+  for (;;)
+    {
+      struct spill_run *tmp;
+      size_t child;
+
+      child = 2 * i + 1;
+      if (child >= num)
+	break;
+      if (child + 1 < num && cmp_spill_runs (heap[child + 1], heap[child]) < 0)
+	child++;
+      if (cmp_spill_runs (heap[i], heap[child]) <= 0)
+	break;
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+    }
+}
+
+/* Write DIR, which has all its entries in spill_fd, to new_db_fd by merging
+   the runs; store its subdirectories to DIR in scan_dir_state.  Exit on
+   error. */
+static void
+write_spilled_directory (struct directory *dir)
+{
+  struct spill_run *runs, **heap;
+  size_t i, num;
+  bool have_space;
+
+  assert (dir->num_entries == 0);
+  write_directory_header (dir);
+  if (changelog_file != NULL)
+    changelog_dir_start (dir->path);
+  runs = xnmalloc (spill_num_runs, sizeof (*runs));
+  heap = xnmalloc (spill_num_runs, sizeof (*heap));
+  num = 0;
+  for (i = 0; i < spill_num_runs; i++)
+    {
+      struct spill_run *run;
+
+      run = runs + i;
+      run->offset = i == 0 ? 0 : spill_run_ends[i - 1];
+      run->end = spill_run_ends[i];
+      run->buf = xmalloc (SPILL_BUFFER_SIZE);
+      run->buf_pos = 0;
+      run->buf_len = 0;
+      run->entry = NULL;
+      run->entry_size = 0;
+      if (spill_run_next (run) != false)
+	{
+	  heap[num] = run;
+	  num++;
+	}
+    }
+  for (i = num / 2; i > 0; i--)
+    spill_heap_down (heap, num, i - 1);
+  have_space = true;
+  while (num != 0)
+    {
+      struct spill_run *run;
+      const char *e;
+      size_t size;
+
+      run = heap[0];
+      e = run->entry;
+      size = sizeof (struct db_entry) + strlen (e + sizeof (struct db_entry))
+	+ 1;
+      memcpy (new_db_reserve (size), e, size);
+      new_db_entries++;
+      if (changelog_file != NULL)
+	changelog_entry (dir->path, e + sizeof (struct db_entry));
+      /* Subdirectories are kept in memory regardless of conf_max_memory; they
+	 are necessary for scan_subdirs (). */
+      if (*e == DBE_DIRECTORY && have_space != false
+	  && dir_add_entry (dir, &scan_dir_state, DBE_DIRECTORY,
+			    e + sizeof (struct db_entry),
+			    size - sizeof (struct db_entry), false) != 0)
+	{
+	  error (0, 0, _("directory `%s' is too large"), dir->path);
+	  have_space = false;
+	}
+      if (spill_run_next (run) == false)
+	{
+	  num--;
+	  heap[0] = heap[num];
+	}
+      spill_heap_down (heap, num, 0);
+    }
+  *new_db_reserve (sizeof (struct db_entry)) = DBE_END;
+  if (changelog_file != NULL)
+    changelog_dir_end (dir->path);
+  for (i = 0; i < spill_num_runs; i++)
+    {
+      free (runs[i].buf);
+      free (runs[i].entry);
+    }
+  free (heap);
+  free (runs);
+  spill_discard ();
+}
+
+/* Return true if scan () will certainly check all subdirectories of PATH */
+static bool
+scan_checks_all_subdirs (const char *path)
+{
+  return (scan_changed_dirs == NULL && conf_subtree == NULL
+	  && budget_stop_path == NULL
+	  && (conf_stagger == 0 || strcmp (path, conf_scan_root) != 0));
+}
+
+/* Scan subdirectories of the current working directory, which has ST, among
+   entries in DIR, and write results to new_db_fd.  The current working
+   directory is not guaranteed to be preserved on return from this function. */
+static void
+scan_subdirs (const struct directory *dir, const struct stat *st)
+{
+  struct prefetch **prefetches;
+  char *path;
+  int cwd_fd, parent_fd;
+  size_t path_size, prefix_len, i, next_prefetch, prunepaths_index;
+  bool top_level, read_entries;
+
+  prefix_len = strlen (dir->path);
+  path_size = prefix_len + 1;
+  path = xmalloc (path_size);
+  memcpy (path, dir->path, prefix_len);
+  assert (prefix_len != 0);
+  if (dir->path[prefix_len - 1] != '/') /* "/" => "/bin", not "//bin" */
+    {
+      path[prefix_len] = '/';
+      prefix_len++;
+    }
+  cwd_fd = -1;
+  top_level = conf_report != NULL && strcmp (dir->path, conf_scan_root) == 0;
+  /* Subdirectories are looked up by prefetch threads relative to PARENT_FD,
+     up to conf_prefetch entries ahead of the one being scanned. */
+  prefetches = NULL;
+  parent_fd = -1;
+  if (prefetch_running () != false && dir->num_entries > 1
+      && scan_checks_all_subdirs (dir->path))
+    {
+      parent_fd = open (".", O_RDONLY | O_DIRECTORY);
+      if (parent_fd != -1)
+	prefetches = xcalloc (dir->num_entries, sizeof (*prefetches));
+    }
+  next_prefetch = 0;
+  /* scan () has checked DIR->path, all subdirectories follow it. */
+  prunepaths_index = conf_prunepaths_index;
+  /* Only directories scan () will read need their entries, the others are
+     compared with the old database by time.  Entries read ahead are not
+     limited by conf_max_memory, so don't read them if it is set. */
+  read_entries = ((old_db_is_closed != false || old_dir.path == NULL)
+		  && conf_max_memory == 0);
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      const char *e;
+
+      if (prefetches != NULL)
+	{
+	  for (; next_prefetch < dir->num_entries
+		 && next_prefetch <= i + conf_prefetch; next_prefetch++)
+	    {
+	      size_t name_size;
+
+	      e = dir_entry (&scan_dir_state, dir, next_prefetch);
+	      if (*e != DBE_DIRECTORY)
+		continue;
+	      e += sizeof (struct db_entry);
+	      if (bsearch (e, conf_prunenames.entries, conf_prunenames.len,
+			   sizeof (*conf_prunenames.entries),
+			   cmp_string_pointer) != NULL)
+		continue;
+	      /* PATH is set again below before scanning entry I. */
+	      name_size = strlen (e) + 1;
+	      while (prefix_len + name_size > path_size)
+		path = x2realloc (path, &path_size);
+	      memcpy (path + prefix_len, e, name_size);
+	      if (string_list_contains_dir_path (&conf_prunepaths,
+						 &prunepaths_index, path))
+		continue;
+	      prefetches[next_prefetch]
+		= prefetch_submit (parent_fd, st->st_dev, e, read_entries);
+	    }
+	}
+      e = dir_entry (&scan_dir_state, dir, i);
+      if (*e == DBE_DIRECTORY)
+	{
+	  size_t name_size;
+	  int res;
+
+	  e += sizeof (struct db_entry);
+	  name_size = strlen (e) + 1;
+	  while (prefix_len + name_size > path_size)
+	    path = x2realloc (path, &path_size);
+	  memcpy (path + prefix_len, e, name_size);
+	  if (prefetches != NULL)
+	    scan_next_prefetch = prefetches[i];
+	  if (top_level != false)
+	    report_subtree_path = path;
+	  /* The entry can move while scanning the subdirectory, use the copy in
+	     PATH. */
+	  res = scan (path, &cwd_fd, st, path + prefix_len);
+	  scan_next_prefetch = NULL;
+	  if (prefetches != NULL && prefetches[i] != NULL)
+	    {
+	      prefetch_free (prefetches[i]);
+	      prefetches[i] = NULL;
+	    }
+	  if (res != 0)
+	    goto err_cwd_fd;
+	}
+    }
+ err_cwd_fd:
+  if (top_level != false)
+    report_subtree_path = NULL;
+  if (prefetches != NULL)
+    {
+      for (i = 0; i < next_prefetch; i++)
+	{
+	  if (prefetches[i] != NULL)
+	    prefetch_free (prefetches[i]);
+	}
+      free (prefetches);
+    }
+  if (parent_fd != -1)
+    close (parent_fd);
+  if (cwd_fd != -1)
+    close (cwd_fd);
+  free (path);
+}
+
+/* If *CWD_FD != -1, open ".", store fd to *CWD_FD; then chdir (RELATIVE),
+   failing if there is a race condition; RELATIVE is supposed to match OLD_ST.
    Return 0 if OK, -1 on error */
 static int
 safe_chdir (int *cwd_fd, const char *relative, const struct stat *old_st)
@@ -520,6 +3000,7 @@ safe_chdir (int *cwd_fd, const char *relative, const struct stat *old_st)
 	return -1;
       *cwd_fd = fd;
     }
+  report_counters[REPORT_LOOKUPS]++;
   if (chdir (relative) != 0 || lstat (".", &st) != 0)
     return -1;
   if (old_st->st_dev != st.st_dev || old_st->st_ino != st.st_ino)
@@ -527,199 +3008,1019 @@ safe_chdir (int *cwd_fd, const char *relative, const struct stat *old_st)
   return 0;
 }
 
-/* Read directory after old_dir to DEST in scan_dir_state;
-   Return -1 on error, 1 if DEST contains a subdirectory, 0 otherwise. */
+/* Copy directory after old_dir to new_db_fd as DEST, without re-encoding its
+   entries, and store the entries to DEST in scan_dir_state.  Return -1 on
+   error (with nothing written; old_dir is kept unless the old database was
+   closed), 1 if DEST contains a subdirectory, 0 otherwise. */
 static int
 copy_old_dir (struct directory *dest)
 {
+  struct old_source *src;
+  off_t entries_offset;
   bool have_subdir;
-  size_t i;
-  void *mark, *p;
+  char *name;
+  void *p;
 
   if (old_db_is_closed || old_dir.path == NULL)
     goto err;
-  mark = obstack_alloc (&scan_dir_state.data_obstack, 0);
+  src = old_dir_source;
+  entries_offset = db_bytes_read (&src->db);
+  dir_start (dest, &scan_dir_state);
   have_subdir = false;
   for (;;)
     {
       struct db_entry entry;
-      struct entry *e;
-      bool is_directory;
       size_t size;
 
-      if (db_read (&old_db, &entry, sizeof (entry)) != 0)
-	goto err_obstack;
+      if (db_read (&src->db, &entry, sizeof (entry)) != 0)
+	goto err_entries;
       switch (entry.type)
 	{
 	case DBE_NORMAL:
-	  is_directory = false;
 	  break;
 
 	case DBE_DIRECTORY:
-	  is_directory = true;
+	  have_subdir = true;
 	  break;
 
 	case DBE_END:
 	  goto done;
 
 	default:
-	  goto err_obstack;
+	  goto err_entries;
 	}
-      {
-	verify (offsetof (struct entry, name) <= OBSTACK_SIZE_MAX);
-      }
-      obstack_blank (&scan_dir_state.data_obstack,
-		     offsetof (struct entry, name));
-      if (db_read_name (&old_db, &scan_dir_state.data_obstack) != 0)
+      if (db_read_name (&src->db, &src->obstack) != 0)
 	goto err_obstack;
-      obstack_1grow (&scan_dir_state.data_obstack, 0);
-      size = (OBSTACK_OBJECT_SIZE (&scan_dir_state.data_obstack)
-	      - offsetof (struct entry, name));
+      obstack_1grow (&src->obstack, 0);
+      size = OBSTACK_OBJECT_SIZE (&src->obstack);
+      name = obstack_finish (&src->obstack);
       if (size > OBSTACK_SIZE_MAX)
 	{
 	  error (0, 0, _("file name length %zu is too large"), size);
-	  goto err_obstack;
+	  goto err_name;
 	}
-      e = obstack_finish (&scan_dir_state.data_obstack);
-      e->name_size = size;
-      e->is_directory = is_directory;
-      if (is_directory != false)
-	have_subdir = true;
-      obstack_ptr_grow (&scan_dir_state.list_obstack, e);
+      if (dest->num_entries != 0
+	  && strcmp (dir_entry (&scan_dir_state, dest, dest->num_entries - 1)
+		     + sizeof (struct db_entry), name) >= 0)
+	goto err_name;
+      if (dir_add_entry (dest, &scan_dir_state, entry.type, name, size, true)
+	  != 0)
+	goto err_too_large;
       if (conf_verbose != false)
-	printf ("%s/%s\n", dest->path, e->name);
+	printf ("%s/%s\n", dest->path, name);
+      obstack_free (&src->obstack, name);
+    }
+ done:
+  dir_finish (dest, &scan_dir_state, false);
+  if (new_db_is_delta != false && old_dir_source == &old_base)
+    /* The record in old_base stays valid. */
+    delta_record (dest->path);
+  else
+    {
+      write_directory_header (dest);
+      new_db_write (scan_dir_state.data + dest->data_start,
+		    scan_dir_state.data_used - dest->data_start);
+      *new_db_reserve (sizeof (struct db_entry)) = DBE_END;
+      new_db_entries += dest->num_entries;
+    }
+  report_counters[REPORT_REUSED]++;
+  PROBE2 (dir__reuse, dest->path, dest->num_entries);
+  return have_subdir;
+
+ err_too_large:
+  /* Let scan_cwd () handle the directory using spill_fd.  Keep old_dir, as
+     for any changed directory, so that the new record can be compared with
+     it. */
+  obstack_free (&src->obstack, name);
+  dir_free (dest, &scan_dir_state);
+  if (db_seek (&src->db, entries_offset) != 0)
+    goto err;
+  return -1;
+
+ err_obstack:
+  p = obstack_finish (&src->obstack);
+  obstack_free (&src->obstack, p);
+  goto err_entries;
+ err_name:
+  obstack_free (&src->obstack, name);
+ err_entries:
+  dir_free (dest, &scan_dir_state);
+ err:
+  old_db_close ();
+  return -1;
+}
+
+static DIR *
+opendir_noatime (const char *path)
+{
+#if defined (HAVE_FDOPENDIR) && defined (O_DIRECTORY) && defined (O_NOATIME)
+  static bool noatime_failed; /* = false; */
+
+  if (noatime_failed == false)
+    {
+      int fd;
+
+      fd = open (path, O_RDONLY | O_DIRECTORY | O_NOATIME);
+      if (fd != -1)
+	return fdopendir (fd);
+      /* EPERM is fairly O_NOATIME-specific; missing access rights cause
+	 EACCES. */
+      else if (errno != EPERM)
+	return NULL;
+      noatime_failed = true;
+    }
+#endif
+  return opendir (path);
+}
+
+/* Return the database entry type of DE in the current working directory */
+static uint8_t
+dirent_type (const struct dirent *de)
+{
+  /* The check for DT_DIR is to handle platforms which have d_type, but
+     require a feature macro to define DT_* */
+#if defined (HAVE_STRUCT_DIRENT_D_TYPE) && defined (DT_DIR)
+  if (de->d_type == DT_DIR)
+    return DBE_DIRECTORY;
+  else if (de->d_type == DT_UNKNOWN)
+#endif
+    {
+      struct stat st;
+
+      report_counters[REPORT_LOOKUPS]++;
+      if (lstat (de->d_name, &st) == 0 && S_ISDIR (st.st_mode))
+	return DBE_DIRECTORY;
+    }
+  return DBE_NORMAL;
+}
+
+/* A subdirectory to look up in inode order */
+struct inode_entry
+{
+  ino_t ino;
+  size_t name;			/* Offset of the name in inode_names */
+};
+
+/* Subdirectories of the current working directory, for
+   lookup_subdirs_by_inode () */
+static struct inode_entry *inode_entries; /* = NULL; */
+static size_t inode_entries_size; /* = 0; */
+/* Names of inode_entries */
+static char *inode_names; /* = NULL; */
+static size_t inode_names_size; /* = 0; */
+
+/* qsort () comparison function for struct inode_entry */
+static int
+cmp_inode_entries (const void *xa, const void *xb)
+{
+  const struct inode_entry *a, *b;
+
+  a = xa;
+  b = xb;
+  return a->ino < b->ino ? -1 : a->ino > b->ino;
+}
+
+/* lstat () subdirectories of the current working directory, which is PATH,
+   in inode number order.  scan_subdirs () then finds the inodes in cache
+   instead of reading inode tables in the random order of names.  The reads
+   are throttled like those of scan (). */
+static void
+lookup_subdirs_by_inode (const char *path)
+{
+  DIR *dir;
+  struct dirent *de;
+  size_t num, names_used, i;
+
+  /* Only look up directories scan () will certainly check. */
+  if (scan_checks_all_subdirs (path) == false)
+    return;
+  throttle ();
+  dir = opendir_noatime (".");
+  if (dir == NULL)
+    return;
+  report_counters[REPORT_READS]++;
+  num = 0;
+  names_used = 0;
+  while ((de = readdir (dir)) != NULL)
+    {
+      size_t name_size;
+
+#if defined (HAVE_STRUCT_DIRENT_D_TYPE) && defined (DT_DIR)
+      if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+	continue;
+#endif
+      if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0
+	  || bsearch (de->d_name, conf_prunenames.entries, conf_prunenames.len,
+		      sizeof (*conf_prunenames.entries),
+		      cmp_string_pointer) != NULL)
+	continue;
+      if (num == inode_entries_size)
+	inode_entries = x2nrealloc (inode_entries, &inode_entries_size,
+				    sizeof (*inode_entries));
+      name_size = strlen (de->d_name) + 1;
+      while (name_size > inode_names_size - names_used)
+	inode_names = x2realloc (inode_names, &inode_names_size);
+      memcpy (inode_names + names_used, de->d_name, name_size);
+      inode_entries[num].ino = de->d_ino;
+      inode_entries[num].name = names_used;
+      names_used += name_size;
+      num++;
+    }
+  closedir (dir);
+  qsort (inode_entries, num, sizeof (*inode_entries), cmp_inode_entries);
+  report_counters[REPORT_LOOKUPS] += num;
+  for (i = 0; i < num; i++)
+    {
+      const char *name;
+      struct stat st;
+
+      name = inode_names + inode_entries[i].name;
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Looking up `%s' in `%s' by inode\n", name, path);
+      throttle ();
+      lstat (name, &st);
+    }
+}
+
+/* Add entry NAME of TYPE to DEST in scan_dir_state, using spill_fd if DEST
+   is too large.  Return -1 if DEST does not fit into scan_dir_state (DEST is
+   freed in that case), 0 if NAME was skipped, 1 if it was added. */
+static int
+scan_add_entry (struct directory *dest, uint8_t type, const char *name)
+{
+  size_t name_size;
+
+  name_size = strlen (name) + 1;
+  if (name_size == 1)
+    {
+      /* Unfortunately, this does happen, and mere assert() does not give
+	 users enough information to complain to the right people. */
+      error (0, 0,
+	     _("file system error: zero-length file name in directory %s"),
+	     dest->path);
+      return 0;
+    }
+  assert (name_size > 1);
+  if (name_size > OBSTACK_SIZE_MAX)
+    {
+      error (0, 0, _("file name length %zu is too large"), name_size);
+      return 0;
+    }
+  if (dir_add_entry (dest, &scan_dir_state, type, name, name_size, true) != 0)
+    {
+      spill_dir (dest, &scan_dir_state);
+      if (dir_add_entry (dest, &scan_dir_state, type, name, name_size,
+			 true) != 0)
+	{
+	  error (0, 0, _("directory `%s' does not fit into --max-memory"),
+		 dest->path);
+	  spill_discard ();
+	  dir_free (dest, &scan_dir_state);
+	  return -1;
+	}
+    }
+  if (conf_verbose != false)
+    printf ("%s/%s\n", dest->path, name);
+  return 1;
+}
+
+/* Finish DEST after scan_add_entry () */
+static void
+scan_finish_entries (struct directory *dest)
+{
+  if (dest->spilled != false)
+    spill_dir (dest, &scan_dir_state);
+  else
+    dir_finish (dest, &scan_dir_state, true);
+}
+
+/* Scan current working directory (DEST.path) to DEST in scan_dir_state,
+   using spill_fd if DEST is too large.  Return -1 if "." can't be opened or
+   DEST does not fit into scan_dir_state, 1 if DEST contains a subdirectory, 0
+   otherwise. */
+static int
+scan_cwd (struct directory *dest)
+{
+  DIR *dir;
+  struct dirent *de;
+  bool have_subdir;
+
+  dir = opendir_noatime (".");
+  if (dir == NULL)
+    return -1;
+  report_counters[REPORT_READS]++;
+  dir_start (dest, &scan_dir_state);
+  have_subdir = false;
+  while ((de = readdir (dir)) != NULL)
+    {
+      uint8_t type;
+      int res;
+
+      if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+	continue;
+      type = dirent_type (de);
+      res = scan_add_entry (dest, type, de->d_name);
+      if (res == -1)
+	{
+	  closedir (dir);
+	  return -1;
+	}
+      if (res != 0 && type == DBE_DIRECTORY)
+	have_subdir = true;
+    }
+  closedir (dir);
+  scan_finish_entries (dest);
+  return have_subdir;
+}
+
+/* Return true if A and B have the same ctime and mtime */
+static bool
+stat_times_equal (const struct stat *a, const struct stat *b)
+{
+  struct time ta, tb;
+
+  time_get_ctime (&ta, a);
+  time_get_ctime (&tb, b);
+  if (time_compare (&ta, &tb) != 0)
+    return false;
+  time_get_mtime (&ta, a);
+  time_get_mtime (&tb, b);
+  return time_compare (&ta, &tb) == 0;
+}
+
+/* Return true if P contains entries of DEST, which has ST, as they are now.
+   Wait for P to be read if necessary. */
+static bool
+prefetch_matches (struct prefetch *p, const struct directory *dest,
+		  const struct stat *st)
+{
+  prefetch_wait (p);
+  if (p->valid == false || p->read_entries == false
+      || p->st.st_dev != st->st_dev || p->st.st_ino != st->st_ino
+      || stat_times_equal (&p->st, st) == false
+      || stat_times_equal (&p->st_after, st) == false)
+    return false;
+  /* The entries were read before ST was looked up; a change right after
+     they were read might not be visible in the timestamps at their
+     resolution, see time_is_current (). */
+  return dest->time.sec + 3 < (uint64_t)p->start;
+}
+
+/* Add entries of P to DEST in scan_dir_state, like scan_cwd ().  Return -1
+   if DEST does not fit into scan_dir_state, 1 if DEST contains a
+   subdirectory, 0 otherwise. */
+static int
+scan_prefetched (struct directory *dest, const struct prefetch *p)
+{
+  size_t pos;
+  bool have_subdir;
+
+  report_counters[REPORT_READS]++;
+  dir_start (dest, &scan_dir_state);
+  have_subdir = false;
+  pos = 0;
+  while (pos < p->entries_used)
+    {
+      const char *name;
+      uint8_t type;
+      int res;
+
+      type = p->entries[pos];
+      name = p->entries + pos + sizeof (struct db_entry);
+      pos += sizeof (struct db_entry) + strlen (name) + 1;
+      res = scan_add_entry (dest, type, name);
+      if (res == -1)
+	return -1;
+      if (res != 0 && type == DBE_DIRECTORY)
+	have_subdir = true;
+    }
+  scan_finish_entries (dest);
+  return have_subdir;
+}
+
+/* Changes of a subtree relative to the old database */
+enum subtree_change
+  {
+    SUBTREE_UNCHANGED,		/* No directory in the subtree changed */
+    SUBTREE_CHANGED_BELOW,	/* Some subdirectories may have changed */
+    SUBTREE_CHANGED_ROOT	/* The root of the subtree changed */
+  };
+
+/* Atomically replace FILENAME by a file containing SIZE bytes at DATA;
+   return 0 if OK, -1 on error (with errno set) */
+static int
+replace_file (const char *filename, const void *data, size_t size)
+{
+  char *tmp;
+  int fd, saved_errno;
+
+  tmp = xmalloc (strlen (filename) + 8);
+  sprintf (tmp, "%s.XXXXXX", filename);
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    goto err;
+  if (full_write (fd, data, size) != size)
+    {
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      goto err_unlink;
+    }
+  if (close (fd) != 0 || rename (tmp, filename) != 0)
+    goto err_unlink;
+  free (tmp);
+  return 0;
+
+ err_unlink:
+  saved_errno = errno;
+  unlink (tmp);
+  errno = saved_errno;
+ err:
+  free (tmp);
+  return -1;
+}
+
+/* Return the name of the file containing the next stagger_slot */
+static const char *
+stagger_filename (void)
+{
+  static char *filename; /* = NULL; */
+
+  if (filename == NULL)
+    {
+      filename = xmalloc (strlen (conf_output) + sizeof (STAGGER_SUFFIX));
+      sprintf (filename, "%s" STAGGER_SUFFIX, conf_output);
+    }
+  return filename;
+}
+
+/* Read stagger_slot for this run */
+static void
+stagger_start (void)
+{
+  char buf[sizeof (unsigned long) * CHAR_BIT + 1], *end;
+  unsigned long value;
+  size_t size;
+  int fd;
+
+  stagger_slot = 0;
+  stagger_index = 0;
+  if (conf_stagger == 0)
+    return;
+  fd = open (stagger_filename (), O_RDONLY);
+  if (fd == -1)
+    return;
+  /* "SLOT\0" */
+  size = safe_read (fd, buf, sizeof (buf));
+  close (fd);
+  if (size == SAFE_READ_ERROR || size == 0 || buf[size - 1] != 0
+      || !isdigit ((unsigned char)*buf))
+    return;
+  errno = 0;
+  value = strtoul (buf, &end, 10);
+  if (*end != 0 || errno != 0)
+    return;
+  stagger_slot = value % conf_stagger;
+}
+
+/* Store stagger_slot of the next run, after the new database was written. */
+static void
+stagger_finish (void)
+{
+  char buf[sizeof (unsigned long) * CHAR_BIT + 1];
+  size_t len;
+
+  if (conf_stagger == 0)
+    return;
+  len = sprintf (buf, "%lu", (stagger_slot + 1) % conf_stagger) + 1;
+  if (replace_file (stagger_filename (), buf, len) != 0)
+    error (0, errno, _("can not write `%s'"), stagger_filename ());
+}
+
+/* Return changes of the subtree rooted at PATH according to conf_stagger */
+static enum subtree_change
+stagger_changes (const char *path)
+{
+  const char *name;
+  size_t root_len;
+  bool check;
+
+  if (conf_stagger == 0 || strcmp (path, conf_scan_root) == 0)
+    return SUBTREE_CHANGED_BELOW;
+  root_len = strlen (conf_scan_root);
+  name = path + root_len;
+  if (conf_scan_root[root_len - 1] != '/') /* "/" => "/bin", not "//bin" */
+    name++;
+  /* Directories below the top level are reached only if their top-level
+     directory is checked. */
+  if (strchr (name, '/') != NULL)
+    return SUBTREE_CHANGED_BELOW;
+  check = stagger_index % conf_stagger == stagger_slot;
+  stagger_index++;
+  if (check != false)
+    return SUBTREE_CHANGED_BELOW;
+  if (conf_debug_pruning != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "Trusting `%s': not checked in this run\n", path);
+  return SUBTREE_UNCHANGED;
+}
+
+/* Return changes of the subtree rooted at PATH according to
+   scan_changed_dirs */
+static enum subtree_change
+subtree_changes (const char *path)
+{
+  const struct string_list *list;
+  size_t len, left, right, i;
+
+  /* Trusted subtrees might contain directories pruned by the current
+     configuration. */
+  if (old_db_pruning_changed != false)
+    return SUBTREE_CHANGED_BELOW;
+  len = strlen (path);
+  if (conf_subtree != NULL)
+    {
+      /* Descend to conf_subtree, and check everything within it. */
+      if (path_is_within (path, conf_subtree, strlen (conf_subtree))
+	  || path_is_within (conf_subtree, path, len))
+	return SUBTREE_CHANGED_BELOW;
+      return SUBTREE_UNCHANGED;
+    }
+  if (scan_changed_dirs == NULL)
+    return stagger_changes (path);
+  for (i = 0; i < scan_unwatched_dirs.len; i++)
+    {
+      const char *dir;
+
+      dir = scan_unwatched_dirs.entries[i];
+      /* Changes in DIR are not reported, so check everything within it, and
+	 descend to it if it is below PATH. */
+      if (path_is_within (path, dir, strlen (dir))
+	  || path_is_within (dir, path, len))
+	return SUBTREE_CHANGED_BELOW;
+    }
+  /* The subtree of PATH immediately follows PATH in dir_path_cmp () order, so
+     it is enough to look at the first entry that is not smaller than PATH. */
+  list = scan_changed_dirs;
+  left = 0;
+  right = list->len;
+  while (left < right)
+    {
+      size_t mid;
+
+      mid = left + (right - left) / 2;
+      if (dir_path_cmp (list->entries[mid], path) < 0)
+	left = mid + 1;
+      else
+	right = mid;
+    }
+  if (left == list->len || path_is_within (list->entries[left], path, len)
+      == false)
+    return SUBTREE_UNCHANGED;
+  if (strcmp (list->entries[left], path) == 0)
+    return SUBTREE_CHANGED_ROOT;
+  return SUBTREE_CHANGED_BELOW;
+}
+
+/* Copy records of PATH, which is at old_dir, and all its subdirectories from
+   the old database to new_db_fd without checking the filesystem.  Return 0 if
+   at least the record of PATH was copied, -1 otherwise. */
+static int
+copy_old_subtree (const char *path)
+{
+  size_t len;
+  bool copied;
+
+  len = strlen (path);
+  copied = false;
+  while (old_dir.path != NULL
+	 && (copied == false || path_is_within (old_dir.path, path, len)))
+    {
+      struct directory dir;
+
+      dir.path = old_dir.path;
+      dir.time = old_dir.time;
+      if (copy_old_dir (&dir) == -1)
+	{
+	  /* The rest of the subtree will be missing in new_db_fd. */
+	  if (copied != false)
+	    scan_incomplete = true;
+	  break;
+	}
+      dir_free (&dir, &scan_dir_state);
+      copied = true;
+      old_dir_next_header ();
+    }
+  return copied != false ? 0 : -1;
+}
+
+/* Write a checkpoint of new_db_fd, which must end with a complete directory
+   record, if it is time to do so. */
+static void
+checkpoint (void)
+{
+  char *filename, offset[sizeof (intmax_t) * CHAR_BIT + 1];
+  size_t len;
+  time_t now;
+  int fd;
+
+  if (conf_checkpoint_interval == 0)
+    return;
+  now = time (NULL);
+  if (now < checkpoint_next)
+    return;
+  checkpoint_next = now + conf_checkpoint_interval;
+  new_db_flush ();
+  if (new_db_errno != 0 || fsync (new_db_fd) != 0)
+    return;
+  filename = xmalloc (strlen (conf_output) + sizeof (CHECKPOINT_SUFFIX) + 7);
+  sprintf (filename, "%s" CHECKPOINT_SUFFIX ".XXXXXX", conf_output);
+  fd = mkstemp (filename);
+  if (fd == -1)
+    goto err;
+  len = sprintf (offset, "%jd", (intmax_t)new_db_offset) + 1;
+  if (full_write (fd, offset, len) != len
+      || full_write (fd, new_db_filename, strlen (new_db_filename) + 1)
+      != strlen (new_db_filename) + 1
+      || fsync (fd) != 0)
+    {
+      close (fd);
+      goto err_unlink;
+    }
+  if (close (fd) != 0 || rename (filename, checkpoint_filename ()) != 0)
+    goto err_unlink;
+  free (filename);
+  if (checkpoint_written == false)
+    {
+      checkpoint_written = true;
+      /* The checkpoint now refers to new_db_filename, keep it if interrupted.
+	 The previous one, if any, is not needed any more. */
+      unlink_set (UNLINK_DB, NULL);
+      if (old_partial_filename != NULL)
+	{
+	  unlink (old_partial_filename);
+	  free (old_partial_filename);
+	  old_partial_filename = NULL;
+	}
+    }
+  return;
+
+ err_unlink:
+  unlink (filename);
+ err:
+  error (0, errno, _("can not write checkpoint `%s'"), checkpoint_filename ());
+  free (filename);
+}
+
+/* Remove the last checkpoint and the files it refers to, after the new
+   database was written */
+static void
+checkpoint_remove (void)
+{
+  if (checkpoint_written == false && old_partial_filename == NULL)
+    return;
+  if (unlink (checkpoint_filename ()) != 0 && errno != ENOENT)
+    error (0, errno, _("can not remove `%s'"), checkpoint_filename ());
+  if (old_partial_filename != NULL)
+    {
+      unlink (old_partial_filename);
+      free (old_partial_filename);
+      old_partial_filename = NULL;
+    }
+}
+
+/* How to handle a directory with respect to conf_time_budget */
+enum budget_state
+  {
+    BUDGET_SCAN,		/* Read it as usual */
+    BUDGET_CHECKED,		/* Copy it, it was read by the previous run */
+    BUDGET_EXHAUSTED		/* Copy it if possible, don't read it */
+  };
+
+/* Return the name of the file containing budget_stop_path */
+static const char *
+budget_position_filename (void)
+{
+  static char *filename; /* = NULL; */
+
+  if (filename == NULL)
+    {
+      filename = xmalloc (strlen (conf_output) + sizeof (POSITION_SUFFIX));
+      sprintf (filename, "%s" POSITION_SUFFIX, conf_output);
     }
- done:
-  dir_finish (dest, &scan_dir_state);
-  for (i = 0; i + 1 < dest->num_entries; i++)
+  return filename;
+}
+
+/* Start measuring conf_time_budget and read budget_resume_path */
+static void
+budget_start (void)
+{
+  char *buf;
+  size_t size, used;
+  int fd;
+
+  budget_stop_path = NULL;
+  budget_resume_path = NULL;
+  if (conf_time_budget == 0)
+    return;
+  budget_deadline = time (NULL) + conf_time_budget;
+  /* Directories before budget_resume_path can be copied only if old_base is
+     usable and its pruning configuration is current. */
+  if (old_db_is_closed != false || old_db_pruning_changed != false)
+    return;
+  fd = open (budget_position_filename (), O_RDONLY);
+  if (fd == -1)
+    return;
+  buf = NULL;
+  size = 0;
+  used = 0;
+  for (;;)
     {
-      struct entry *a, *b;
+      size_t run;
 
-      a = dest->entries[i];
-      b = dest->entries[i + 1];
-      if (strcmp (a->name, b->name) >= 0)
-	goto err_obstack;
+      if (used == size)
+	buf = x2realloc (buf, &size);
+      run = safe_read (fd, buf + used, size - used);
+      if (run == SAFE_READ_ERROR)
+	goto err;
+      if (run == 0)
+	break;
+      used += run;
     }
-  return have_subdir;
+  if (used == 0 || buf[used - 1] != 0 || strlen (buf) != used - 1
+      || path_is_within (buf, conf_scan_root, strlen (conf_scan_root))
+      == false)
+    goto err;
+  close (fd);
+  budget_resume_path = buf;
+  return;
 
- err_obstack:
-  (void)obstack_finish (&scan_dir_state.data_obstack);
-  obstack_free (&scan_dir_state.data_obstack, mark);
-  p = obstack_finish (&scan_dir_state.list_obstack);
-  obstack_free (&scan_dir_state.list_obstack, p);
  err:
-  old_db_close ();
-  return -1;
+  close (fd);
+  free (buf);
 }
 
-/* Compare two "void *" (struct entry *) values */
-static int
-cmp_entries (const void *xa, const void *xb)
+/* Return how to handle directory PATH with respect to conf_time_budget */
+static enum budget_state
+budget_check (const char *path)
 {
-  void *const *a_, *const *b_;
-  struct entry *a, *b;
+  if (conf_time_budget == 0)
+    return BUDGET_SCAN;
+  /* Ancestors of budget_resume_path are always read, so every run reads at
+     least one directory after budget_resume_path. */
+  if (budget_resume_path != NULL
+      && dir_path_cmp (path, budget_resume_path) <= 0)
+    return (path_is_within (budget_resume_path, path, strlen (path))
+	    ? BUDGET_SCAN : BUDGET_CHECKED);
+  if (budget_stop_path == NULL)
+    {
+      if (time (NULL) < budget_deadline)
+	return BUDGET_SCAN;
+      budget_stop_path = xstrdup (path);
+      /* Changes in the copied directories are not known. */
+      scan_incomplete = true;
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Time budget exhausted at `%s'\n", path);
+    }
+  return BUDGET_EXHAUSTED;
+}
 
-  a_ = xa;
-  b_ = xb;
-  a = *a_;
-  b = *b_;
-  return strcmp (a->name, b->name);
+/* Store budget_stop_path for the next run, after the new database was
+   written. */
+static void
+budget_finish (void)
+{
+  if (conf_time_budget == 0)
+    return;
+  free (budget_resume_path);
+  budget_resume_path = NULL;
+  if (budget_stop_path == NULL)
+    {
+      /* The next run should start from the beginning. */
+      if (unlink (budget_position_filename ()) != 0 && errno != ENOENT)
+	error (0, errno, _("can not remove `%s'"),
+	       budget_position_filename ());
+      return;
+    }
+  if (replace_file (budget_position_filename (), budget_stop_path,
+		    strlen (budget_stop_path) + 1) != 0)
+    error (0, errno, _("can not write `%s'"), budget_position_filename ());
+  free (budget_stop_path);
+  budget_stop_path = NULL;
 }
 
-static DIR *
-opendir_noatime (const char *path)
+/* A directory written with a zero time because its time was too current */
+struct current_dir
 {
-#if defined (HAVE_FDOPENDIR) && defined (O_DIRECTORY) && defined (O_NOATIME)
-  static bool noatime_failed; /* = false; */
+  off_t offset;			/* Offset of the header in new_db_fd */
+  size_t size;			/* Size of the record in new_db_fd */
+  struct time time;		/* The real time of the directory */
+  dev_t dev;
+  ino_t ino;
+  char *path;
+};
 
-  if (noatime_failed == false)
-    {
-      int fd;
+/* Directories to revalidate after scanning */
+static struct current_dir *current_dirs;
+static size_t current_dirs_len, current_dirs_size; /* = 0; */
 
-      fd = open (path, O_RDONLY | O_DIRECTORY | O_NOATIME);
-      if (fd != -1)
-	return fdopendir (fd);
-      /* EPERM is fairly O_NOATIME-specific; missing access rights cause
-	 EACCES. */
-      else if (errno != EPERM)
-	return NULL;
-      noatime_failed = true;
-    }
-#endif
-  return opendir (path);
+/* Note that DIR, with real time TIME and ST, was just written to new_db_fd
+   with a zero time. */
+static void
+current_dir_add (const struct directory *dir, const struct time *time,
+		 const struct stat *st)
+{
+  struct current_dir *cd;
+
+  if (current_dirs_len == current_dirs_size)
+    current_dirs = x2nrealloc (current_dirs, &current_dirs_size,
+			       sizeof (*current_dirs));
+  cd = current_dirs + current_dirs_len;
+  cd->offset = new_db_dir_offset;
+  cd->size = new_db_offset + new_db_buffer_used - new_db_dir_offset;
+  cd->time = *time;
+  cd->dev = st->st_dev;
+  cd->ino = st->st_ino;
+  cd->path = xstrdup (dir->path);
+  current_dirs_len++;
+}
+
+/* Forget all directories in current_dirs */
+static void
+current_dirs_discard (void)
+{
+  size_t i;
+
+  for (i = 0; i < current_dirs_len; i++)
+    free (current_dirs[i].path);
+  current_dirs_len = 0;
 }
 
-/* Scan current working directory (DEST.path) to DEST in scan_dir_state;
-   Return -1 if "." can't be opened, 1 if DEST contains a subdirectory,
-   0 otherwise. */
+/* Read entries of the current working directory (DEST.path) to DEST in
+   scan_dir_state, without reporting anything.  Return 0 if OK, -1 if "." can't
+   be read or it contains entries scan_cwd () would skip. */
 static int
-scan_cwd (struct directory *dest)
+current_dir_read (struct directory *dest)
 {
   DIR *dir;
   struct dirent *de;
-  bool have_subdir;
 
   dir = opendir_noatime (".");
   if (dir == NULL)
     return -1;
-  have_subdir = false;
+  dir_start (dest, &scan_dir_state);
   while ((de = readdir (dir)) != NULL)
     {
-      struct entry *e;
-      size_t name_size, entry_size;
+      size_t name_size;
 
       if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
 	continue;
       name_size = strlen (de->d_name) + 1;
-      if (name_size == 1)
-	{
-	  /* Unfortunately, this does happen, and mere assert() does not give
-	     users enough information to complain to the right people. */
-	  error (0, 0,
-		 _("file system error: zero-length file name in directory %s"),
-		 dest->path);
-	  continue;
-	}
-      assert (name_size > 1);
-      entry_size = offsetof (struct entry, name) + name_size;
-      if (entry_size > OBSTACK_SIZE_MAX)
-	{
-	  error (0, 0, _("file name length %zu is too large"), name_size);
-	  continue;
-	}
-      e = obstack_alloc (&scan_dir_state.data_obstack, entry_size);
-      e->name_size = name_size;
-      memcpy (e->name, de->d_name, name_size);
-      e->is_directory = false;
-      /* The check for DT_DIR is to handle platforms which have d_type, but
-	 require a feature macro to define DT_* */
-#if defined (HAVE_STRUCT_DIRENT_D_TYPE) && defined (DT_DIR)
-      if (de->d_type == DT_DIR)
-	e->is_directory = true;
-      else if (de->d_type == DT_UNKNOWN)
-#endif
+      if (name_size == 1 || name_size > OBSTACK_SIZE_MAX
+	  || dir_add_entry (dest, &scan_dir_state, dirent_type (de),
+			    de->d_name, name_size, true) != 0)
 	{
-	  struct stat st;
-	  
-	  if (lstat (e->name, &st) == 0 && S_ISDIR (st.st_mode))
-	    e->is_directory = true;
+	  closedir (dir);
+	  dir_free (dest, &scan_dir_state);
+	  return -1;
 	}
-      if (e->is_directory != false)
-	have_subdir = true;
-      obstack_ptr_grow (&scan_dir_state.list_obstack, e);
-      if (conf_verbose != false)
-	printf ("%s/%s\n", dest->path, e->name);
     }
   closedir (dir);
-  dir_finish (dest, &scan_dir_state);
-  qsort (dest->entries, dest->num_entries, sizeof (*dest->entries),
-	 cmp_entries);
-  return have_subdir;
+  dir_finish (dest, &scan_dir_state, true);
+  return 0;
+}
+
+/* Check whether the record in new_db_fd described by CD, read into RECORD,
+   matches DIR in scan_dir_state. */
+static bool
+current_dir_record_matches (const struct current_dir *cd, const char *record,
+			    const struct directory *dir)
+{
+  const char *p, *end;
+  size_t i;
+
+  p = record + sizeof (struct db_directory);
+  end = record + cd->size;
+  if (strcmp (p, cd->path) != 0)
+    return false;
+  p += strlen (p) + 1;
+  for (i = 0; i < dir->num_entries; i++)
+    {
+      const char *e;
+      size_t size;
+
+      e = dir_entry (&scan_dir_state, dir, i);
+      size = sizeof (struct db_entry) + strlen (e + sizeof (struct db_entry))
+	+ 1;
+      if (size > (size_t)(end - p) || memcmp (p, e, size) != 0)
+	return false;
+      p += size;
+    }
+  return end - p == sizeof (struct db_entry) && *p == DBE_END;
+}
+
+/* chdir () to absolute PATH, which may be longer than PATH_MAX.  Return 0 if
+   OK, -1 on error. */
+static int
+current_dir_chdir (const char *path)
+{
+  char *copy, *component;
+  int res;
+
+  if (chdir (path) == 0)
+    return 0;
+  if (errno != ENAMETOOLONG)
+    return -1;
+  /* Walk down from the root using relative names, like scan () does.  The
+     caller verifies that the result is the expected directory. */
+  copy = xstrdup (path);
+  res = chdir ("/");
+  for (component = strtok (copy, "/"); component != NULL && res == 0;
+       component = strtok (NULL, "/"))
+    res = chdir (component);
+  free (copy);
+  return res;
+}
+
+/* Revalidate the record of CD in new_db_fd, which must be flushed: if the time
+   of the directory is no longer current and its entries did not change, write
+   the real time to the record.  Use *RECORD with *RECORD_SIZE as a
+   buffer. */
+static void
+current_dir_revalidate (const struct current_dir *cd, char **record,
+			size_t *record_size)
+{
+  struct directory dir;
+  struct stat st;
+  struct time time, mtime;
+  bool matches;
+
+  /* Any change to the directory after this check changes its timestamp, so
+     the entries read below are valid for cd->time if it did not change. */
+  if (time_is_current (&cd->time))
+    return;
+  if (current_dir_chdir (cd->path) != 0 || lstat (".", &st) != 0
+      || st.st_dev != cd->dev || st.st_ino != cd->ino)
+    return;
+  time_get_ctime (&time, &st);
+  time_get_mtime (&mtime, &st);
+  if (time_compare (&time, &mtime) < 0)
+    time = mtime;
+  if (time_compare (&time, &cd->time) != 0)
+    return;
+  dir.path = cd->path;
+  if (current_dir_read (&dir) != 0)
+    return;
+  if (*record_size < cd->size)
+    {
+      *record_size = cd->size;
+      free (*record);
+      *record = xmalloc (*record_size);
+    }
+  matches = (pread (new_db_fd, *record, cd->size, cd->offset)
+	      == (ssize_t)cd->size
+	     && current_dir_record_matches (cd, *record, &dir));
+  dir_free (&dir, &scan_dir_state);
+  if (matches != false)
+    {
+      struct db_directory header;
+
+      memset (&header, 0, sizeof (header));
+      header.time_sec = htonll (cd->time.sec);
+      header.time_nsec = htonl (cd->time.nsec);
+      if (pwrite (new_db_fd, &header, sizeof (header), cd->offset)
+	  != sizeof (header))
+	new_db_errno = errno != 0 ? errno : EIO;
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Revalidated `%s'\n", cd->path);
+    }
+}
+
+/* Revalidate all records in current_dirs, see current_dir_revalidate (), and
+   forget them.  new_db_fd must be flushed. */
+static void
+current_dirs_revalidate (void)
+{
+  char *record;
+  size_t i, record_size;
+
+  record = NULL;
+  record_size = 0;
+  /* Pretend the scan took conf_debug_scan_time more seconds. */
+  time_set_offset (conf_debug_scan_time);
+  for (i = 0; i < current_dirs_len && new_db_errno == 0; i++)
+    current_dir_revalidate (current_dirs + i, &record, &record_size);
+  time_set_offset (0);
+  free (record);
+  current_dirs_discard ();
 }
 
 /* Scan filesystem subtree rooted at PATH, which is "./RELATIVE", and write
-   results to new_db.  Try to preserve current working directory (opening a
-   file descriptor to it in *CWD_FD, if *CWD_FD == -1).  Use ST_PARENT for
+   results to new_db_fd.  Try to preserve current working directory (opening
+   a file descriptor to it in *CWD_FD, if *CWD_FD == -1).  Use ST_PARENT for
    checking whether a PATH is a mount point.  Return -1 if the current working
    directory couldn't be preserved, 0 otherwise.
 
@@ -731,11 +4032,22 @@ scan (char *path, int *cwd_fd, const struct stat *st_parent,
 {
   struct directory dir;
   struct stat st;
-  struct time mtime;
-  void *entries_mark;
-  int cmp, res;
-  bool have_subdir, did_chdir;
+  struct mount_info mi;
+  struct time mtime, real_time;
+  struct report_stats mark;
+  struct prefetch *prefetch;
+  enum subtree_change change;
+  enum budget_state budget;
+  dev_t dev;
+  int cmp, res, result;
+  bool have_subdir, did_chdir, is_current, use_prefetch, bind_mount_checked;
 
+  PROBE1 (dir__start, path);
+  result = 0;
+  prefetch = scan_next_prefetch;
+  scan_next_prefetch = NULL;
+  report_mark (&mark, new_db_offset + new_db_buffer_used);
+  dev = st_parent->st_dev;
   if (string_list_contains_dir_path (&conf_prunepaths, &conf_prunepaths_index,
 				     path))
     {
@@ -744,12 +4056,19 @@ scan (char *path, int *cwd_fd, const struct stat *st_parent,
 	fprintf (stderr, "Skipping `%s': in prunepaths\n", path);
       goto err;
     }
-  if (conf_prune_bind_mounts != false && is_bind_mount (path))
+  /* Without mount information, check PATH before looking it up; looking up a
+     bind mount of an unreachable NFS server could hang. */
+  bind_mount_checked = false;
+  if (conf_prune_bind_mounts != false && mount_info_available == false)
     {
-      if (conf_debug_pruning != false)
-	/* This is debuging output, don't mark anything for translation */
-	fprintf (stderr, "Skipping `%s': bind mount\n", path);
-      goto err;
+      bind_mount_checked = true;
+      if (is_bind_mount (path))
+	{
+	  if (conf_debug_pruning != false)
+	    /* This is debuging output, don't mark anything for translation */
+	    fprintf (stderr, "Skipping `%s': bind mount\n", path);
+	  goto err;
+	}
     }
   if (bsearch (relative, conf_prunenames.entries, conf_prunenames.len,
 	       sizeof (*conf_prunenames.entries), cmp_string_pointer) != NULL)
@@ -759,9 +4078,55 @@ scan (char *path, int *cwd_fd, const struct stat *st_parent,
 	fprintf (stderr, "Skipping `%s': in prunenames\n", path);
       goto err;
     }
-  if (lstat (relative, &st) != 0)
+  cmp = 1;
+  while (old_dir.path != NULL && (cmp = dir_path_cmp (old_dir.path, path)) < 0)
+    {
+      old_dir_skip ();
+      old_dir_next_header ();
+    }
+  budget = budget_check (path);
+  if (budget != BUDGET_SCAN)
+    {
+      /* Copy the subtree as it is; with different pruning configuration, it
+	 is better to leave it out and read it in the next run. */
+      if (old_dir.path != NULL && cmp == 0 && old_db_pruning_changed == false
+	  && copy_old_subtree (path) == 0)
+	goto err;
+      if (budget == BUDGET_EXHAUSTED)
+	goto err;
+      /* The old record of PATH, if any, is not usable. */
+      cmp = 1;
+    }
+  change = subtree_changes (path);
+  if (change == SUBTREE_UNCHANGED && old_dir.path != NULL && cmp == 0)
+    {
+      if (copy_old_subtree (path) == 0)
+	goto err;
+      /* The old record of PATH, if any, is not usable. */
+      cmp = 1;
+    }
+  throttle ();
+  report_counters[REPORT_LOOKUPS]++;
+  if (lstat_mount_info (relative, &st, &mi) != 0)
+    goto err;
+  dev = st.st_dev;
+  /* Other filesystems are read by other mount workers, or by the main
+     process. */
+  if (mount_worker_dev_only != false && st.st_dev != mount_worker_dev)
     goto err;
-  if (st.st_dev != st_parent->st_dev && filesystem_is_excluded (path))
+  if (conf_prune_bind_mounts != false
+      && (bind_mount_checked == false || mi.known != false)
+      && dir_is_bind_mount (path, &mi))
+    {
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Skipping `%s': bind mount\n", path);
+      goto err;
+    }
+  /* With statx () we also recognize mount points that don't change st_dev. */
+  if ((st.st_dev != st_parent->st_dev
+       || (mi.is_root != false && st.st_ino != st_parent->st_ino))
+      && filesystem_is_excluded (path))
     {
       if (conf_debug_pruning != false)
 	/* This is debuging output, don't mark anything for translation */
@@ -770,20 +4135,16 @@ scan (char *path, int *cwd_fd, const struct stat *st_parent,
     }
   /* "relative" may now become a symlink to somewhere else.  So we use it only
      in safe_chdir (). */
-  entries_mark = obstack_alloc (&scan_dir_state.data_obstack, 0);
   dir.path = path;
   time_get_ctime (&dir.time, &st);
   time_get_mtime (&mtime, &st);
   if (time_compare (&dir.time, &mtime) < 0)
     dir.time = mtime;
-  while (old_dir.path != NULL && (cmp = dir_path_cmp (old_dir.path, path)) < 0)
-    {
-      old_dir_skip ();
-      old_dir_next_header ();
-    }
   did_chdir = false;
   have_subdir = false;
-  if (old_dir.path != NULL && cmp == 0
+  /* Don't rely on timestamps for directories known to be changed, the change
+     might not be visible at their resolution. */
+  if (old_dir.path != NULL && cmp == 0 && change != SUBTREE_CHANGED_ROOT
       && time_compare (&dir.time, &old_dir.time) == 0
       && (dir.time.sec != 0 || dir.time.nsec != 0))
     {
@@ -792,122 +4153,491 @@ scan (char *path, int *cwd_fd, const struct stat *st_parent,
 	{
 	  have_subdir = res;
 	  old_dir_next_header ();
-	  goto have_dir;
+	  goto have_record;
 	}
     }
-  if (time_is_current (&dir.time))
+  use_prefetch = prefetch != NULL && prefetch_matches (prefetch, &dir, &st);
+  is_current = time_is_current (&dir.time);
+  if (is_current != false)
     {
       /* The directory might be changing right now and we can't be sure the
 	 timestamp will be changed again if more changes happen very soon, mark
 	 the timestamp as invalid to force rescanning the directory next time
-	 updatedb is run. */
+	 updatedb is run, unless current_dirs_revalidate () can fix it. */
+      real_time = dir.time;
       dir.time.sec = 0;
       dir.time.nsec = 0;
     }
   did_chdir = true;
   if (safe_chdir (cwd_fd, relative, &st) != 0)
     goto err_chdir;
-  res = scan_cwd (&dir);
+  if (use_prefetch != false)
+    res = scan_prefetched (&dir, prefetch);
+  else
+    res = scan_cwd (&dir);
   if (res == -1)
     goto err_chdir;
   have_subdir = res;
- have_dir:
-  write_directory (&dir);
+  /* The old record of PATH is not usable if cmp != 0. */
+  if (old_dir.path == NULL || cmp != 0)
+    report_counters[REPORT_NEW]++;
+  else if (old_dir.time.sec == 0 && old_dir.time.nsec == 0)
+    report_counters[REPORT_FORCED]++;
+  else
+    report_counters[REPORT_CHANGED]++;
+  if (dir.spilled != false)
+    write_spilled_directory (&dir);
+  else
+    {
+      write_directory (&dir);
+      if (is_current != false)
+	current_dir_add (&dir, &real_time, &st);
+    }
+ have_record:
+  checkpoint ();
   if (have_subdir != false)
     {
+      dir_keep_subdirs (&dir, &scan_dir_state);
       if (did_chdir == false)
 	{
 	  did_chdir = true;
 	  if (safe_chdir (cwd_fd, relative, &st) != 0)
 	    goto err_entries;
 	}
+      /* DIR now contains only the subdirectories. */
+      if (conf_inode_order != false && dir.num_entries > 1)
+	lookup_subdirs_by_inode (path);
+      /* Subdirectories report about themselves. */
+      report_add (&mark, new_db_offset + new_db_buffer_used, dev, path);
       scan_subdirs (&dir, &st);
+      report_mark (&mark, new_db_offset + new_db_buffer_used);
     }
  err_entries:
-  obstack_free (&scan_dir_state.list_obstack, dir.entries);
-  obstack_free (&scan_dir_state.data_obstack, entries_mark);
+  dir_free (&dir, &scan_dir_state);
  err_chdir:
   if (did_chdir != false && *cwd_fd != -1 && fchdir (*cwd_fd) != 0)
-    return -1;
+    result = -1;
  err:
+  report_add (&mark, new_db_offset + new_db_buffer_used, dev, path);
+  PROBE1 (dir__end, path);
+  return result;
+}
+
+/* Write memory use statistics of scan_dir_state to stderr */
+static void
+report_memory_use (void)
+{
+  /* This is debuging output, don't mark anything for translation */
+  fprintf (stderr,
+	   "Directory entries: peak use %zu bytes, allocated %zu bytes\n",
+	   scan_dir_state.peak_memory,
+	   (scan_dir_state.data_size
+	    + scan_dir_state.offsets_size * sizeof (*scan_dir_state.offsets)));
+  if (scan_dir_state.largest_dir_path != NULL)
+    fprintf (stderr, "Largest directory: `%s', %zu bytes\n",
+	     scan_dir_state.largest_dir_path,
+	     scan_dir_state.largest_dir_memory);
+  if (spill_total_dirs != 0)
+    fprintf (stderr, "Spilled directories: %zu, sorted runs: %zu\n",
+	     spill_total_dirs, spill_total_runs);
+}
+
+ /* Parallel reading of mounted filesystems */
+
+/* A mounted filesystem read by a mount worker */
+struct worker_mount
+{
+  char *dir;			/* Mount point, canonical */
+  char *fsname;			/* Mounted device */
+  size_t group;			/* Index of the worker reading DIR */
+};
+
+/* Mounted filesystems read by mount workers, sorted by dir */
+static struct worker_mount *worker_mounts; /* = NULL; */
+static size_t num_worker_mounts; /* = 0; */
+
+/* Process IDs of the mount workers */
+static pid_t *mount_worker_pids; /* = NULL; */
+static size_t num_mount_workers; /* = 0; */
+
+/* qsort () comparison function for struct worker_mount */
+static int
+cmp_worker_mount (const void *xa, const void *xb)
+{
+  const struct worker_mount *a, *b;
+
+  a = xa;
+  b = xb;
+  return dir_path_cmp (a->dir, b->dir);
+}
+
+/* Return true if scan () would never reach mount point DIR */
+static bool
+mount_is_pruned (const char *dir)
+{
+  size_t i, root_len;
+  char *name, *p;
+  bool pruned;
+
+  for (i = 0; i < conf_prunepaths.len; i++)
+    {
+      const char *prune;
+
+      prune = conf_prunepaths.entries[i];
+      if (path_is_within (dir, prune, strlen (prune)))
+	return true;
+    }
+  /* Check all path components below conf_scan_root */
+  root_len = strlen (conf_scan_root);
+  name = xstrdup (dir + root_len);
+  pruned = false;
+  for (p = strtok (name, "/"); p != NULL && pruned == false;
+       p = strtok (NULL, "/"))
+    pruned = bsearch (p, conf_prunenames.entries, conf_prunenames.len,
+		      sizeof (*conf_prunenames.entries),
+		      cmp_string_pointer) != NULL;
+  free (name);
+  return pruned;
+}
+
+/* Collect filesystems mounted within conf_scan_root to worker_mounts, and
+   return the number of worker groups.  Filesystems on the same device are
+   in the same group. */
+static size_t
+worker_mounts_collect (void)
+{
+  FILE *f;
+  struct mntent *me;
+  size_t allocated, root_len, num_groups, i, j;
+
+  f = setmntent (MOUNT_TABLE_PATH, "r");
+  if (f == NULL)
+    return 0;
+  root_len = strlen (conf_scan_root);
+  allocated = 0;
+  while ((me = getmntent (f)) != NULL)
+    {
+      char *dir;
+
+#ifndef PROC_MOUNTS_PATH
+      dir = canonicalize_file_name (me->mnt_dir);
+      if (dir == NULL)
+	continue;
+#else
+      /* See filesystem_is_excluded () */
+      dir = xstrdup (me->mnt_dir);
+#endif
+      if (strcmp (dir, conf_scan_root) == 0
+	  || path_is_within (dir, conf_scan_root, root_len) == false
+	  || filesystem_type_is_excluded (me->mnt_type)
+	  || mount_is_pruned (dir))
+	{
+	  free (dir);
+	  continue;
+	}
+      if (num_worker_mounts == allocated)
+	worker_mounts = x2nrealloc (worker_mounts, &allocated,
+				    sizeof (*worker_mounts));
+      worker_mounts[num_worker_mounts].dir = dir;
+      worker_mounts[num_worker_mounts].fsname = xstrdup (me->mnt_fsname);
+      num_worker_mounts++;
+    }
+  endmntent (f);
+  qsort (worker_mounts, num_worker_mounts, sizeof (*worker_mounts),
+	 cmp_worker_mount);
+  num_groups = 0;
+  for (i = 0; i < num_worker_mounts; i++)
+    {
+      for (j = 0; j < i; j++)
+	{
+	  if (strcmp (worker_mounts[j].fsname, worker_mounts[i].fsname) == 0)
+	    break;
+	}
+      if (j < i)
+	worker_mounts[i].group = worker_mounts[j].group;
+      else
+	{
+	  worker_mounts[i].group = num_groups;
+	  num_groups++;
+	}
+    }
+  return num_groups;
+}
+
+/* Free worker_mounts */
+static void
+worker_mounts_free (void)
+{
+  size_t i;
+
+  for (i = 0; i < num_worker_mounts; i++)
+    {
+      free (worker_mounts[i].dir);
+      free (worker_mounts[i].fsname);
+    }
+  free (worker_mounts);
+  worker_mounts = NULL;
+  num_worker_mounts = 0;
+}
+
+/* Replace SRC->db.fd, positioned at OFFSET, by a file descriptor not shared
+   with the main process.  Return 0 if OK, -1 on error. */
+static int
+mount_worker_reopen (struct old_source *src, const char *filename,
+		     off_t offset)
+{
+  struct stat st, new_st;
+  int fd;
+
+  if (filename == NULL)
+    return -1;
+  fd = open (filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (fstat (src->db.fd, &st) != 0 || fstat (fd, &new_st) != 0
+      || st.st_dev != new_st.st_dev || st.st_ino != new_st.st_ino
+      || lseek (fd, offset, SEEK_SET) != offset
+      || dup2 (fd, src->db.fd) == -1)
+    {
+      close (fd);
+      return -1;
+    }
+  close (fd);
   return 0;
 }
 
- /* Unlinking of temporary database file */
+/* Prepare a newly created mount worker: make sure it does not modify any
+   state shared with the main process.  OFFSETS are the offsets of
+   old_sources. */
+static void
+mount_worker_detach (const off_t *offsets)
+{
+  size_t i;
+  int fd;
 
-/* An absolute path to the file to unlink or NULL */
-static const char *unlink_path; /* = NULL; */
+  unlink_set (UNLINK_DB, NULL);
+  unlink_set (UNLINK_CHANGELOG, NULL);
+  fd = open ("/dev/null", O_RDWR);
+  if (fd == -1 || dup2 (fd, new_db_fd) == -1 || dup2 (fd, STDOUT_FILENO) == -1
+      || dup2 (fd, STDERR_FILENO) == -1)
+    _exit (EXIT_FAILURE);
+  close (fd);
+  /* spill_fd shares the file offset with the main process, and may contain
+     runs it is merging; spill_dir () will create a new file if needed. */
+  if (spill_fd != -1)
+    {
+      close (spill_fd);
+      spill_fd = -1;
+      free (spill_buffer);
+      spill_buffer_used = 0;
+      spill_num_runs = 0;
+      spill_size = 0;
+    }
+  changelog_file = NULL;
+  conf_report = NULL;
+  new_db_is_delta = false;
+  conf_checkpoint_interval = 0;
+  conf_debug_memory = false;
+  conf_debug_pruning = false;
+  conf_debug_throttle = false;
+  conf_verbose = false;
+  if (conf_prune_bind_mounts != false)
+    bind_mount_reinit ();
+  if (old_db_is_closed != false)
+    return;
+  for (i = 0; i < ARRAY_SIZE (old_sources); i++)
+    {
+      struct old_source *src;
+      char *filename;
+      int res;
 
-/* Signals which try to unlink unlink_path */
-static sigset_t unlink_sigset;
+      src = old_sources[i];
+      if (src->db.fd == -1)
+	continue;
+      if (src == &old_partial)
+	filename = xstrdup (old_partial_filename);
+      else if (src == &old_delta)
+	{
+	  filename = xmalloc (strlen (conf_output) + sizeof (DB_DELTA_SUFFIX));
+	  sprintf (filename, "%s" DB_DELTA_SUFFIX, conf_output);
+	}
+      else
+	filename = xstrdup (conf_output);
+      res = mount_worker_reopen (src, filename, offsets[i]);
+      free (filename);
+      if (res != 0)
+	{
+	  /* Read everything from the filesystem instead. */
+	  old_db_close ();
+	  return;
+	}
+    }
+}
 
-/* Unlink unlink_path */
+/* Read mount point DIR in a mount worker */
 static void
-unlink_db (void)
+mount_worker_scan (const char *dir)
 {
-  if (unlink_path != NULL)
-    unlink (unlink_path);
+  struct stat st_parent, st;
+  char *path, *parent, *relative;
+  size_t parent_len;
+  int cwd_fd;
+
+  path = xstrdup (dir);
+  relative = strrchr (path, '/') + 1;
+  parent_len = relative - 1 - path;
+  if (parent_len == 0) /* "/bin" => "/", not "" */
+    parent_len = 1;
+  parent = xmalloc (parent_len + 1);
+  memcpy (parent, path, parent_len);
+  parent[parent_len] = 0;
+  if (chdir (parent) != 0 || lstat (".", &st_parent) != 0
+      || lstat (relative, &st) != 0)
+    goto err;
+  mount_worker_dev = st.st_dev;
+  mount_worker_dev_only = true;
+  cwd_fd = -1;
+  scan (path, &cwd_fd, &st_parent, relative);
+  if (cwd_fd != -1)
+    close (cwd_fd);
+ err:
+  free (parent);
+  free (path);
 }
 
-/* SIGINT/SIGTERM handler */
+/* Run a mount worker for GROUP, with OFFSETS of old_sources; acquire a byte
+   from TOKENS_FD[0] while reading the filesystems and return it to
+   TOKENS_FD[1]. */
 static void attribute__ ((noreturn))
-unlink_signal (int sig)
+mount_worker_run (size_t group, const off_t *offsets, const int *tokens_fd)
 {
-  sigset_t mask;
+  size_t i;
+  char token;
 
-  unlink_db ();
-  signal (sig, SIG_DFL);
-  sigemptyset (&mask);
-  sigaddset (&mask, sig);
-  sigprocmask (SIG_UNBLOCK, &mask, NULL);
-  raise (sig);
-  _exit (EXIT_FAILURE);
+  mount_worker_detach (offsets);
+  if (safe_read (tokens_fd[0], &token, 1) != 1)
+    _exit (EXIT_FAILURE);
+  for (i = 0; i < num_worker_mounts; i++)
+    {
+      if (worker_mounts[i].group == group)
+	mount_worker_scan (worker_mounts[i].dir);
+    }
+  full_write (tokens_fd[1], &token, 1);
+  _exit (EXIT_SUCCESS);
 }
 
-/* Set unlink_path to PATH (which must remain valid until next unlink_set () */
+/* Start mount workers, which read the filesystems mounted within
+   conf_scan_root in parallel with the main process, so that it finds the
+   data in caches when it reaches them.  The mount workers don't write
+   anything. */
 static void
-unlink_set (const char *path)
+mount_workers_start (void)
 {
-  sigset_t old;
+  off_t offsets[ARRAY_SIZE (old_sources)];
+  size_t num_groups, num_tokens, group, i;
+  int tokens_fd[2];
 
-  sigprocmask (SIG_BLOCK, &unlink_sigset, &old);
-  unlink_path = path;
-  sigprocmask (SIG_SETMASK, &old, NULL);
+  num_groups = worker_mounts_collect ();
+  if (num_groups == 0)
+    goto done;
+  for (i = 0; i < ARRAY_SIZE (old_sources); i++)
+    {
+      if (old_sources[i]->db.fd != -1)
+	offsets[i] = lseek (old_sources[i]->db.fd, 0, SEEK_CUR);
+    }
+  if (pipe (tokens_fd) != 0)
+    goto done;
+  /* At most conf_mount_workers workers, and at most one for each device, run
+     at the same time. */
+  num_tokens = num_groups;
+  if (num_tokens > conf_mount_workers)
+    num_tokens = conf_mount_workers;
+  for (i = 0; i < num_tokens; i++)
+    {
+      if (full_write (tokens_fd[1], "", 1) != 1)
+	goto err_tokens;
+    }
+  mount_worker_pids = xnmalloc (num_groups, sizeof (*mount_worker_pids));
+  for (group = 0; group < num_groups; group++)
+    {
+      pid_t pid;
+
+      pid = fork ();
+      if (pid == 0)
+	mount_worker_run (group, offsets, tokens_fd);
+      if (pid == -1)
+	break;
+      mount_worker_pids[num_mount_workers] = pid;
+      num_mount_workers++;
+    }
+  if (conf_debug_pruning != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "Started %zu mount workers for %zu filesystems\n",
+	     num_mount_workers, num_worker_mounts);
+ err_tokens:
+  close (tokens_fd[0]);
+  close (tokens_fd[1]);
+ done:
+  worker_mounts_free ();
 }
 
-/* Initialize the unlinking code */
+/* Stop all mount workers */
 static void
-unlink_init (void)
+mount_workers_stop (void)
 {
-  static const int signals[] = { SIGABRT, SIGINT, SIGTERM };
+  size_t i, finished;
 
-  struct sigaction sa;
-  size_t i;
+  /* The workers only exist to fill caches, their remaining work would not
+     be useful. */
+  for (i = 0; i < num_mount_workers; i++)
+    kill (mount_worker_pids[i], SIGKILL);
+  finished = 0;
+  for (i = 0; i < num_mount_workers; i++)
+    {
+      pid_t pid;
+      int status;
 
-  atexit (unlink_db);
-  sigemptyset (&unlink_sigset);
-  for (i = 0; i < ARRAY_SIZE(signals); i++)
-    sigaddset (&unlink_sigset, signals[i]);
-  sa.sa_handler = unlink_signal;
-  sa.sa_mask = unlink_sigset;
-  sa.sa_flags = 0;
-  for (i = 0; i < ARRAY_SIZE(signals); i++)
-    sigaction (signals[i], &sa, NULL);
+      while ((pid = waitpid (mount_worker_pids[i], &status, 0)) == -1
+	     && errno == EINTR)
+	;
+      if (pid != -1 && WIFEXITED (status)
+	  && WEXITSTATUS (status) == EXIT_SUCCESS)
+	finished++;
+    }
+  if (conf_debug_pruning != false && num_mount_workers != 0)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "Mount workers: %zu finished, %zu stopped\n", finished,
+	     num_mount_workers - finished);
+  free (mount_worker_pids);
+  mount_worker_pids = NULL;
+  num_mount_workers = 0;
 }
 
- /* Top level */
+ /* Database update */
 
 /* Open a temporary file for the new database and initialize its header
-   and configuration block.  Exit on error. */
+   and configuration block, for a delta relative to old_base if
+   new_db_is_delta.  Exit on error. */
 static void
 new_db_open (void)
 {
   static const uint8_t magic[] = DB_MAGIC;
 
   struct db_header db_header;
-  char *filename;
+  char *filename, *prefix;
+  size_t prefix_size;
   int db_fd;
-  
+
+  prefix = NULL;
+  prefix_size = 0;
+  if (new_db_is_delta != false)
+    {
+      struct stat st;
+
+      if (fstat (old_base.db.fd, &st) != 0)
+	error (EXIT_FAILURE, errno, _("can not stat () `%s'"), conf_output);
+      delta_conf_prefix (&prefix, &prefix_size, &st);
+    }
   filename = xmalloc (strlen (conf_output) + 8);
   sprintf (filename, "%s.XXXXXX", conf_output);
   db_fd = mkstemp (filename);
@@ -915,23 +4645,37 @@ new_db_open (void)
     error (EXIT_FAILURE, 0, _("can not open a temporary file for `%s'"),
 	   conf_output);
   new_db_filename = filename;
-  unlink_set (filename);
-  new_db = fdopen (db_fd, "wb");
-  if (new_db == NULL)
-    error (EXIT_FAILURE, errno, _("can not open `%s'"), new_db_filename);
+  unlink_set (UNLINK_DB, filename);
+  new_db_fd = db_fd;
+  new_db_buffer = xmalloc (NEW_DB_BUFFER_SIZE);
+  new_db_offset = 0;
+  new_db_entries = 0;
+  if (conf_checkpoint_interval != 0)
+    {
+      /* Tell old_partial_open () in other processes that the file is in
+	 use. */
+      lock_database (db_fd, F_SETLK);
+      checkpoint_next = time (NULL) + conf_checkpoint_interval;
+      checkpoint_written = false;
+    }
   memset (&db_header, 0, sizeof (db_header));
   {
     verify (sizeof (db_header.magic) == sizeof (magic));
   }
   memcpy (db_header.magic, &magic, sizeof (magic));
-  if (conf_block_size > UINT32_MAX)
+  if (conf_block_size > UINT32_MAX - prefix_size)
     error (EXIT_FAILURE, 0, _("configuration is too large"));
-  db_header.conf_size = htonl (conf_block_size);
+  db_header.conf_size = htonl (prefix_size + conf_block_size);
   db_header.version = DB_VERSION_0;
   db_header.check_visibility = conf_check_visibility;
-  fwrite (&db_header, sizeof (db_header), 1, new_db);
-  fwrite (conf_scan_root, 1, strlen (conf_scan_root) + 1, new_db);
-  fwrite (conf_block, 1, conf_block_size, new_db);
+  new_db_write (&db_header, sizeof (db_header));
+  new_db_write (conf_scan_root, strlen (conf_scan_root) + 1);
+  if (prefix != NULL)
+    {
+      new_db_write (prefix, prefix_size);
+      free (prefix);
+    }
+  new_db_write (conf_block, conf_block_size);
 }
 
 /* Set up permissions of new_db_filename.  Exit on error. */
@@ -967,67 +4711,598 @@ new_db_setup_permissions (void)
 	   new_db_filename);
 }
 
-int
-main (int argc, char *argv[])
+/* A _temporary_ file name of the change log */
+static char *changelog_filename;
+
+/* Open a temporary file for the change log.  Exit on error. */
+static void
+changelog_open (void)
 {
-  struct stat st;
-  int lock_file_fd, cwd_fd;
+  int fd;
 
-  set_program_name (argv[0]);
-  dir_path_cmp_init ();
-  setlocale (LC_ALL, "");
-  bindtextdomain (PACKAGE_NAME, LOCALEDIR);
-  textdomain (PACKAGE_NAME);
-  conf_prepare (argc, argv);
-  if (conf_prune_bind_mounts != false)
-    bind_mount_init (MOUNTINFO_PATH);
-  lock_file_fd = old_db_open ();
-  if (lock_file_fd != -1)
+  changelog_filename = xmalloc (strlen (conf_changelog) + 8);
+  sprintf (changelog_filename, "%s.XXXXXX", conf_changelog);
+  fd = mkstemp (changelog_filename);
+  if (fd == -1)
+    error (EXIT_FAILURE, errno, _("can not open a temporary file for `%s'"),
+	   conf_changelog);
+  unlink_set (UNLINK_CHANGELOG, changelog_filename);
+  changelog_file = fdopen (fd, "w");
+  if (changelog_file == NULL)
+    error (EXIT_FAILURE, errno, _("can not open a temporary file for `%s'"),
+	   conf_changelog);
+}
+
+/* Close and remove the temporary change log file */
+static void
+changelog_discard (void)
+{
+  fclose (changelog_file);
+  changelog_file = NULL;
+  unlink (changelog_filename);
+  unlink_set (UNLINK_CHANGELOG, NULL);
+  free (changelog_filename);
+}
+
+/* Finish the change log and replace conf_changelog by it.  If CHANGES_KNOWN is
+   false, replace its contents by a record saying the changes are not known.
+   Exit on error. */
+static void
+changelog_close (bool changes_known)
+{
+  if (changes_known == false)
     {
-      struct flock lk;
+      if (fflush (changelog_file) != 0
+	  || ftruncate (fileno (changelog_file), 0) != 0)
+	error (EXIT_FAILURE, errno, _("I/O error while writing to `%s'"),
+	       changelog_filename);
+      rewind (changelog_file);
+      putc ('!', changelog_file);
+      putc (0, changelog_file);
+    }
+  if (fwriteerror (changelog_file))
+    error (EXIT_FAILURE, errno, _("I/O error while writing to `%s'"),
+	   changelog_filename);
+  changelog_file = NULL;
+  if (rename (changelog_filename, conf_changelog) != 0)
+    error (EXIT_FAILURE, errno, _("error replacing `%s'"), conf_changelog);
+  unlink_set (UNLINK_CHANGELOG, NULL);
+  free (changelog_filename);
+}
+
+/* Check whether the database locked as FD was replaced by another file */
+static bool
+database_was_replaced (int fd)
+{
+  struct stat locked, current;
+
+  /* If conf_output was removed, the updatedb holding the lock has not
+     replaced it. */
+  return (fstat (fd, &locked) == 0 && stat (conf_output, &current) == 0
+	  && (locked.st_dev != current.st_dev
+	      || locked.st_ino != current.st_ino));
+}
+
+/* Close the old database, using LOCK_FILE_FD if old_base is not valid (which
+   releases the lock), and free its data */
+static void
+old_db_release (int lock_file_fd)
+{
+  if (old_base.db.fd != -1)
+    db_close (&old_base.db);
+  else if (lock_file_fd != -1)
+    /* old_base is invalid, but the file was used for locking */
+    close (lock_file_fd);
+  old_db_free ();
+}
+
+/* Update the database.  If CHANGED is not NULL, it contains all directories
+   that might have changed since the old database was written, sorted by
+   dir_path_cmp (); records of other subtrees are copied without checking the
+   filesystem.  Return 0 if OK, -1 if the database is locked (exit on this
+   error if LOCK_FATAL).  Exit on other errors. */
+static int
+update_database (const struct string_list *changed, bool lock_fatal)
+{
+  struct stat st;
+  char *delta_filename;
+  int lock_file_fd, cwd_fd, replacements;
 
-      lk.l_type = F_WRLCK;
-      lk.l_whence = SEEK_SET;
-      lk.l_start = 0;
-      lk.l_len = 0;
-      if (fcntl (lock_file_fd, F_SETLK, &lk) == -1)
+  /* With conf_coalesce, the run that holds the lock when we start might
+     have read the file system before our caller changed it.  Only a run that
+     started after it, i.e. the one that replaces the database for the second
+     time, is guaranteed to see the changes; if nobody else starts one, we
+     do. */
+  replacements = 0;
+  for (;;)
+    {
+      lock_file_fd = old_db_open ();
+      if (lock_file_fd == -1 || lock_database (lock_file_fd, F_SETLK) == 0)
+	break;
+      if (errno != EACCES && errno != EAGAIN)
+	error (EXIT_FAILURE, errno, _("can not lock `%s'"), conf_output);
+      if (conf_coalesce == false)
+	{
+	  error (lock_fatal != false ? EXIT_FAILURE : 0, 0,
+		 _("`%s' is locked (probably by an earlier updatedb)"),
+		 conf_output);
+	  old_db_release (lock_file_fd);
+	  return -1;
+	}
+      if (conf_debug_pruning != false)
+	/* This is debuging output, don't mark anything for translation */
+	fprintf (stderr, "Waiting for `%s' to be unlocked\n", conf_output);
+      if (lock_database (lock_file_fd, F_SETLKW) != 0)
+	error (EXIT_FAILURE, errno, _("can not lock `%s'"), conf_output);
+      if (database_was_replaced (lock_file_fd) == false)
+	/* The other updatedb failed, the database we have read is current. */
+	break;
+      old_db_release (lock_file_fd);
+      replacements++;
+      if (replacements == 2)
 	{
-	  if (errno == EACCES || errno == EAGAIN)
-	    error (EXIT_FAILURE, 0,
-		   _("`%s' is locked (probably by an earlier updatedb)"),
-		   conf_output);
-	  error (EXIT_FAILURE, errno, _("can not lock `%s'"), conf_output);
+	  if (conf_debug_pruning != false)
+	    /* This is debuging output, don't mark anything for translation */
+	    fprintf (stderr, "`%s' was updated by another updatedb\n",
+		     conf_output);
+	  return 0;
 	}
     }
-  unlink_init ();
-  new_db_open ();
-  dir_state_init (&scan_dir_state);
-  if (chdir (conf_scan_root) != 0)
-    error (EXIT_FAILURE, errno, _("can not change directory to `%s'"),
-	   conf_scan_root);
-  if (lstat (".", &st) != 0)
-    error (EXIT_FAILURE, errno, _("can not stat () `%s'"), conf_scan_root);
-  cwd_fd = -1;
-  scan (conf_scan_root, &cwd_fd, &st, ".");
-  if (cwd_fd != -1)
-    close (cwd_fd);
-  if (fwriteerror (new_db))
-    error (EXIT_FAILURE, errno, _("I/O error while writing to `%s'"),
+  /* A delta can be written only if old_base is valid, and it would have to
+     describe all changes caused by different pruning configuration or
+     records reused from old_partial. */
+  new_db_is_delta = (conf_delta != false && old_db_is_closed == false
+		     && old_db_pruning_changed == false
+		     && old_partial.db.fd == -1);
+  for (;;)
+    {
+      new_db_open ();
+      if (conf_changelog != NULL)
+	changelog_open ();
+      conf_prunepaths_index = 0;
+      scan_changed_dirs = changed;
+      scan_incomplete = false;
+      if (chdir (conf_scan_root) != 0)
+	error (EXIT_FAILURE, errno, _("can not change directory to `%s'"),
+	       conf_scan_root);
+      if (lstat (".", &st) != 0)
+	error (EXIT_FAILURE, errno, _("can not stat () `%s'"),
+	       conf_scan_root);
+      cwd_fd = -1;
+      budget_start ();
+      stagger_start ();
+      throttle_start ();
+      report_start ();
+      /* Reading only changed directories is already fast. */
+      if (conf_mount_workers != 0 && scan_changed_dirs == NULL
+	  && conf_subtree == NULL)
+	mount_workers_start ();
+      prefetch_start ();
+      scan (conf_scan_root, &cwd_fd, &st, ".");
+      prefetch_stop ();
+      mount_workers_stop ();
+      if (cwd_fd != -1)
+	close (cwd_fd);
+      scan_changed_dirs = NULL;
+      if (new_db_is_delta != false)
+	delta_finish ();
+      else if (changelog_file != NULL)
+	/* Log entries of removed directories */
+	old_dir_skip_rest ();
+      if (new_db_is_delta == false || old_db_is_closed == false)
+	break;
+      /* The delta can not describe the old_base records that were not read,
+	 so write the whole database instead. */
+      error (0, 0, _("error reading `%s', writing a complete database"),
+	     conf_output);
+      close (new_db_fd);
+      unlink (new_db_filename);
+      unlink_set (UNLINK_DB, NULL);
+      free (new_db_filename);
+      free (new_db_buffer);
+      new_db_buffer_used = 0;
+      if (changelog_file != NULL)
+	changelog_discard ();
+      current_dirs_discard ();
+      new_db_is_delta = false;
+    }
+  if (conf_debug_memory != false)
+    report_memory_use ();
+  if (conf_debug_throttle != false)
+    report_throttling ();
+  new_db_flush ();
+  if (budget_stop_path == NULL)
+    current_dirs_revalidate ();
+  else
+    current_dirs_discard ();
+  free (new_db_buffer);
+  if (new_db_errno == 0 && close (new_db_fd) != 0)
+    new_db_errno = errno;
+  if (new_db_errno != 0)
+    error (EXIT_FAILURE, new_db_errno, _("I/O error while writing to `%s'"),
 	   new_db_filename);
   new_db_setup_permissions ();
-  if (rename (new_db_filename, conf_output) != 0)
-    error (EXIT_FAILURE, errno, _("error replacing `%s'"), conf_output);
+  delta_filename = xmalloc (strlen (conf_output) + sizeof (DB_DELTA_SUFFIX));
+  sprintf (delta_filename, "%s" DB_DELTA_SUFFIX, conf_output);
+  if (new_db_is_delta != false)
+    {
+      if (rename (new_db_filename, delta_filename) != 0)
+	error (EXIT_FAILURE, errno, _("error replacing `%s'"), delta_filename);
+    }
+  else
+    {
+      if (rename (new_db_filename, conf_output) != 0)
+	error (EXIT_FAILURE, errno, _("error replacing `%s'"), conf_output);
+      /* The delta, if any, is already included in the new database, and it
+	 would be ignored anyway because it refers to the old file. */
+      if (unlink (delta_filename) != 0 && errno != ENOENT)
+	error (0, errno, _("can not remove `%s'"), delta_filename);
+    }
+  free (delta_filename);
+  checkpoint_remove ();
+  budget_finish ();
+  stagger_finish ();
+  report_write (new_db_offset);
+  report_metrics (new_db_offset, new_db_entries);
+  if (changelog_file != NULL)
+    /* If old_db_is_closed, some or all of the old database was not read.
+       old_partial hides the differences between old_base and the file
+       system. */
+    changelog_close (old_db_is_closed == false && old_partial.db.fd == -1);
   /* There is really no race condition in removing other files now: unlink ()
      only removes the directory entry (not symlink targets), and the file had
      to be intentionally placed there to match the mkstemp () result.  So any
      attacker can at most remove their own data. */
-  unlink_set (NULL);
+  unlink_set (UNLINK_DB, NULL);
   free (new_db_filename);
-  if (old_db.fd != -1)
-    db_close(&old_db); /* Releases the lock */
-  else if (lock_file_fd != -1)
-    /* old_db is invalid, but the file was used for locking */
-    close(lock_file_fd); /* Releases the lock */
+  old_db_release (lock_file_fd); /* Releases the lock */
+  return 0;
+}
+
+ /* Watching for changes */
+
+#ifdef USE_FANOTIFY
+/* A filesystem marked for watching */
+struct watch_fs
+{
+  fsid_t fsid;
+  int fd;			/* A directory on the filesystem */
+};
+
+/* Filesystems marked for watching */
+static struct watch_fs *watch_fs;
+static size_t watch_num_fs, watch_fs_size; /* = 0; */
+
+/* Directory containing conf_output, changes in it are ignored */
+static char *watch_output_dir;
+
+/* Mark the filesystem containing PATH in fanotify FD.
+   Return 0 if OK, -1 on error. */
+static int
+watch_add_fs (int fd, const char *path)
+{
+  struct statfs sfs;
+  int dir_fd;
+  size_t i;
+
+  dir_fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return -1;
+  if (fstatfs (dir_fd, &sfs) != 0)
+    goto err_dir_fd;
+  for (i = 0; i < watch_num_fs; i++)
+    {
+      if (memcmp (&watch_fs[i].fsid, &sfs.f_fsid, sizeof (sfs.f_fsid)) == 0)
+	{
+	  close (dir_fd);
+	  return 0;
+	}
+    }
+  if (fanotify_mark (fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+		     FAN_CREATE | FAN_DELETE | FAN_MOVE | FAN_ONDIR, dir_fd,
+		     NULL) != 0)
+    goto err_dir_fd;
+  if (conf_debug_pruning != false)
+    /* This is debuging output, don't mark anything for translation */
+    fprintf (stderr, "Watching filesystem of `%s'\n", path);
+  if (watch_num_fs == watch_fs_size)
+    watch_fs = x2nrealloc (watch_fs, &watch_fs_size, sizeof (*watch_fs));
+  watch_fs[watch_num_fs].fsid = sfs.f_fsid;
+  watch_fs[watch_num_fs].fd = dir_fd;
+  watch_num_fs++;
+  return 0;
+
+ err_dir_fd:
+  close (dir_fd);
+  return -1;
+}
+
+/* Start watching filesystems in conf_scan_root.  Filesystems that can not be
+   watched are added to scan_unwatched_dirs.  Return a fanotify file
+   descriptor, or -1 if changes can not be watched at all. */
+static int
+watch_init (void)
+{
+  FILE *f;
+  struct mntent *me;
+  size_t root_len;
+  char *p;
+  int fd;
+
+  fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DIR_FID | FAN_CLOEXEC
+		      | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    goto err;
+  if (watch_add_fs (fd, conf_scan_root) != 0)
+    goto err_fd;
+  f = setmntent (MOUNT_TABLE_PATH, "r");
+  if (f == NULL)
+    goto err_fd;
+  root_len = strlen (conf_scan_root);
+  while ((me = getmntent (f)) != NULL)
+    {
+      size_t i;
+
+      if (path_is_within (me->mnt_dir, conf_scan_root, root_len) == false
+	  || filesystem_type_is_excluded (me->mnt_type))
+	continue;
+      for (i = 0; i < conf_prunepaths.len; i++)
+	{
+	  const char *prune;
+
+	  prune = conf_prunepaths.entries[i];
+	  if (path_is_within (me->mnt_dir, prune, strlen (prune)))
+	    break;
+	}
+      if (i == conf_prunepaths.len && watch_add_fs (fd, me->mnt_dir) != 0)
+	{
+	  if (conf_debug_pruning != false)
+	    /* This is debuging output, don't mark anything for translation */
+	    fprintf (stderr, "Can not watch filesystem of `%s'\n", me->mnt_dir);
+	  string_list_append (&scan_unwatched_dirs, xstrdup (me->mnt_dir));
+	}
+    }
+  endmntent (f);
+  watch_output_dir = xstrdup (conf_output);
+  p = strrchr (watch_output_dir, '/');
+  assert (p != NULL);
+  if (p == watch_output_dir)
+    p++;
+  *p = 0;
+  return fd;
+
+ err_fd:
+  close (fd);
+ err:
+  error (0, errno,
+	 _("can not watch for changes, checking the whole file system"));
+  return -1;
+}
+
+/* Return the absolute path of the directory described by INFO, for free (),
+   or NULL if it is not available. */
+static char *
+watch_fid_path (const struct fanotify_event_info_fid *info)
+{
+  char proc_path[sizeof ("/proc/self/fd/") + sizeof (int) * CHAR_BIT];
+  char *buf;
+  size_t i, size;
+  ssize_t len;
+  int fd;
+
+  for (i = 0; i < watch_num_fs; i++)
+    {
+      if (memcmp (&watch_fs[i].fsid, &info->fsid, sizeof (info->fsid)) == 0)
+	break;
+    }
+  if (i == watch_num_fs)
+    return NULL;
+  /* Fails with ESTALE if the directory was removed in the meantime; its
+     parent is reported as changed as well. */
+  fd = open_by_handle_at (watch_fs[i].fd, (struct file_handle *)info->handle,
+			  O_PATH | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  sprintf (proc_path, "/proc/self/fd/%d", fd);
+  buf = NULL;
+  size = 0;
+  for (;;)
+    {
+      buf = x2realloc (buf, &size);
+      len = readlink (proc_path, buf, size);
+      if (len == -1 || (size_t)len < size)
+	break;
+    }
+  close (fd);
+  if (len == -1 || buf[0] != '/')
+    {
+      free (buf);
+      return NULL;
+    }
+  buf[len] = 0;
+  return buf;
+}
+
+/* Read events from fanotify FD, add changed directories to CHANGED.  Return 0
+   if OK, -1 if some events were lost. */
+static int
+watch_read_events (int fd, struct string_list *changed)
+{
+  static union
+  {
+    struct fanotify_event_metadata metadata;
+    char buf[64 * 1024];
+  } u;
+
+  size_t root_len;
+  int res;
+
+  root_len = strlen (conf_scan_root);
+  res = 0;
+  for (;;)
+    {
+      const struct fanotify_event_metadata *m;
+      ssize_t len;
+
+      len = read (fd, u.buf, sizeof (u.buf));
+      if (len == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN)
+	    {
+	      error (0, errno, _("error reading file system changes"));
+	      res = -1;
+	    }
+	  break;
+	}
+      for (m = &u.metadata; FAN_EVENT_OK (m, len); m = FAN_EVENT_NEXT (m, len))
+	{
+	  const struct fanotify_event_info_fid *info;
+	  char *path;
+
+	  if (m->vers != FANOTIFY_METADATA_VERSION
+	      || (m->mask & FAN_Q_OVERFLOW) != 0)
+	    {
+	      res = -1;
+	      continue;
+	    }
+	  info = (const struct fanotify_event_info_fid *)(m + 1);
+	  if (m->event_len < m->metadata_len + sizeof (*info)
+	      || info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+	    continue;
+	  path = watch_fid_path (info);
+	  if (path == NULL)
+	    continue;
+	  if (path_is_within (path, conf_scan_root, root_len) == false
+	      || strcmp (path, watch_output_dir) == 0)
+	    {
+	      free (path);
+	      continue;
+	    }
+	  if (conf_debug_pruning != false)
+	    /* This is debuging output, don't mark anything for translation */
+	    fprintf (stderr, "Changed: `%s'\n", path);
+	  string_list_append (changed, path);
+	}
+    }
+  return res;
+}
+#endif
+
+/* Free all entries of LIST */
+static void
+watch_clear_list (struct string_list *list)
+{
+  size_t i;
+
+  for (i = 0; i < list->len; i++)
+    free (list->entries[i]);
+  list->len = 0;
+}
+
+/* Sort LIST using dir_path_cmp () and remove duplicates */
+static void
+watch_sort_list (struct string_list *list)
+{
+  size_t src, dest;
+
+  string_list_dir_path_sort (list);
+  dest = 0;
+  for (src = 0; src < list->len; src++)
+    {
+      if (dest != 0 && strcmp (list->entries[dest - 1], list->entries[src])
+	  == 0)
+	free (list->entries[src]);
+      else
+	{
+	  list->entries[dest] = list->entries[src];
+	  dest++;
+	}
+    }
+  list->len = dest;
+}
+
+/* Keep updating the database every conf_watch_interval seconds, rescanning
+   only directories reported as changed if possible. */
+static void attribute__ ((noreturn))
+watch (void)
+{
+  struct string_list changed;
+  time_t next;
+  bool full;
+  int fd;
+
+  memset (&changed, 0, sizeof (changed));
+#ifdef USE_FANOTIFY
+  fd = watch_init ();
+#else
+  error (0, 0, _("can not watch for changes, checking the whole file system"));
+  fd = -1;
+#endif
+  full = true;
+  next = time (NULL);
+  for (;;)
+    {
+      time_t now;
+
+      now = time (NULL);
+      if (now < next)
+	{
+#ifdef USE_FANOTIFY
+	  if (fd != -1)
+	    {
+	      struct pollfd pfd;
+
+	      pfd.fd = fd;
+	      pfd.events = POLLIN;
+	      poll (&pfd, 1, (next - now) * 1000);
+	    }
+	  else
+#endif
+	    sleep (next - now);
+	}
+#ifdef USE_FANOTIFY
+      if (fd != -1 && watch_read_events (fd, &changed) != 0)
+	full = true;
+#endif
+      if (time (NULL) < next)
+	continue;
+      /* Filesystems that can not be watched are checked in every pass. */
+      if (full != false || changed.len != 0 || scan_unwatched_dirs.len != 0)
+	{
+	  watch_sort_list (&changed);
+	  if (update_database (full != false ? NULL : &changed, false) == 0)
+	    {
+	      full = fd == -1 || scan_incomplete != false;
+	      watch_clear_list (&changed);
+	    }
+	  if (fflush (stdout) != 0 || ferror (stdout))
+	    error (EXIT_FAILURE, errno,
+		   _("I/O error while writing to standard output"));
+	}
+      next = time (NULL) + conf_watch_interval;
+    }
+}
+
+ /* Top level */
+
+int
+main (int argc, char *argv[])
+{
+  set_program_name (argv[0]);
+  dir_path_cmp_init ();
+  setlocale (LC_ALL, "");
+  bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+  textdomain (PACKAGE_NAME);
+  conf_prepare (argc, argv);
+  if (conf_prune_bind_mounts != false)
+    bind_mount_init (MOUNTINFO_PATH);
+  unlink_init ();
+  dir_state_init (&scan_dir_state);
+  if (conf_watch_interval != 0)
+    watch ();
+  update_database (NULL, true);
   if (fwriteerror (stdout))
     error (EXIT_FAILURE, errno,
 	   _("I/O error while writing to standard output"));
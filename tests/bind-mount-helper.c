@@ -29,12 +29,34 @@ Author: Miloslav Trmač <mitr@redhat.com> */
 
 bool conf_debug_pruning; /* = false; */
 
+/* Check PATHS in order, and forget them */
+static void
+check_paths (struct string_list *paths)
+{
+  size_t i;
+
+  string_list_dir_path_sort (paths);
+  for (i = 0; i < paths->len; i++)
+    {
+      const char *p;
+
+      p = paths->entries[i];
+      printf ("%s %s\n", is_bind_mount (p) ? "yes" : "no ", p);
+    }
+  paths->len = 0;
+}
+
+/* Usage: bind-mount-helper [-d] MOUNTINFO ARG...
+   where ARG is a path to check, "-i ID" to check mount ID, or "-r FILE" to
+   replace MOUNTINFO by FILE.  Paths are checked in sorted order, up to the
+   next -i or -r; a -i of a mount ID not in the current copy of MOUNTINFO
+   makes it reread. */
 int
 main (int argc, char *argv[])
 {
   struct string_list paths;
+  const char *mountinfo;
   int i;
-  size_t j;
 
   assert (argc >= 2);
   i = 1;
@@ -45,19 +67,37 @@ main (int argc, char *argv[])
     }
   assert (argc > i);
 
-  bind_mount_init (argv[i]);
+  mountinfo = argv[i];
+  bind_mount_init (mountinfo);
 
   memset (&paths, 0, sizeof (paths));
-  for (i++; i < argc; i++)
-    string_list_append (&paths, argv[i]);
   dir_path_cmp_init ();
-  string_list_dir_path_sort (&paths);
-  for (j = 0; j < paths.len; j++)
+  for (i++; i < argc; i++)
     {
-      const char *p;
+      if (strcmp (argv[i], "-i") == 0)
+	{
+	  int id;
 
-      p = paths.entries[j];
-      printf ("%s %s\n", is_bind_mount (p) ? "yes" : "no ", p);
+	  assert (i + 1 < argc);
+	  check_paths (&paths);
+	  i++;
+	  id = atoi (argv[i]);
+	  printf ("%s id %d\n", is_bind_mount_id (id) ? "yes" : "no ", id);
+	}
+      else if (strcmp (argv[i], "-r") == 0)
+	{
+	  assert (i + 1 < argc);
+	  check_paths (&paths);
+	  i++;
+	  if (rename (argv[i], mountinfo) != 0)
+	    {
+	      perror ("rename");
+	      return EXIT_FAILURE;
+	    }
+	}
+      else
+	string_list_append (&paths, argv[i]);
     }
+  check_paths (&paths);
   return EXIT_SUCCESS;
 }